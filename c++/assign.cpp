@@ -18,21 +18,20 @@ typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> PermMatrix;
 void Sys::permuteCols(const PermMatrix &perm, Sys &other)
 {
     // permute local matrices
-    T = T * perm;
-    Pavg = Pavg * perm;
-    Pm2 = Pm2 * perm;
     M = M * perm;
 
+    // renumbers the test ratings, shared by both Sys
+    T->permute(perm, T_by_row);
+
     if (has_prop_posterior())
     {
         propMu *= perm;
         propLambda *= perm;
+        propLambdaL *= perm;
+        propLambdaMu *= perm;
     }
 
     // permute other matrices
-    other.T = T.transpose();
-    other.Pavg = Pavg.transpose();
-    other.Pm2 = Pm2.transpose();
     other.M = M.transpose();
 
     col_permutation = col_permutation * perm;
@@ -42,8 +41,6 @@ void Sys::unpermuteCols(Sys &other)
 {
     auto perm = col_permutation.inverse();
     permuteCols(perm, other);
-
-    assert_same_struct(T, Torig);
 }
 
 //
@@ -70,22 +67,22 @@ void Sys::assign(Sys &other)
         // comm_cost[i][j] == communication cost if item i is assigned to processor j
         for(int i=0; i<num(); ++i) {
             std::vector<unsigned> comm_per_proc(nprocs);
-            const int count = M.innerVector(i).nonZeros();
-            for (SparseMatrixD::InnerIterator it(M,i); it; ++it) comm_per_proc.at(other.proc(it.row()))++;
+            const int count = M.nnz(i);
+            for (RatingMatrix::InnerIterator it(M,i); it; ++it) comm_per_proc.at(other.proc(it.row()))++;
             for(int j=0; j<nprocs; j++) comm_cost.at(i).push_back(count - comm_per_proc.at(j));
         }
     }
 
-    std::vector<unsigned> nnz_per_proc(nprocs);
+    std::vector<long>     nnz_per_proc(nprocs);
     std::vector<unsigned> items_per_proc(nprocs);
     std::vector<double>   work_per_proc(nprocs);
 
     std::vector<int> item_to_proc(num(), -1);
 
-    unsigned total_nnz   = 1;
+    long     total_nnz   = 1;
     unsigned total_items = 1;
     double   total_work  = 0.01;
-    unsigned total_comm  = 0;
+    long     total_comm  = 0;
 
     // computes best node to assign movie/user idx
     auto best = [&](int idx, double r1, double r2) {
@@ -108,7 +105,7 @@ void Sys::assign(Sys &other)
 
     // update cost function when item is assigned to proc
     auto assign = [&](int item, int proc) {
-        const int nnz = M.innerVector(item).nonZeros();
+        const int nnz = M.nnz(item);
         double work = 10.0 + nnz; // one item is as expensive as  NZs
         item_to_proc[item] = proc;
         nnz_per_proc  [proc] += nnz;
@@ -124,7 +121,7 @@ void Sys::assign(Sys &other)
     auto unassign = [&](int item) {
         int proc = item_to_proc[item];
         if (proc < 0) return;
-        const int nnz = M.innerVector(item).nonZeros();
+        const int nnz = M.nnz(item);
         double work = 7.1 + nnz;
         item_to_proc[item] = -1;
         nnz_per_proc  [proc] -= nnz;
@@ -140,16 +137,16 @@ void Sys::assign(Sys &other)
     // print cost after iterating once
     auto print = [&](int iter) {
         Sys::cout() << name << " -- iter " << iter << " -- \n";
-        std::vector<unsigned> test_ratings_per_proc(nprocs);
+        std::vector<long> test_ratings_per_proc(nprocs);
         for (int i = 0; i < num(); ++i)
         {
             int proc = item_to_proc[i];
-            test_ratings_per_proc[proc] += T.col(i).nonZeros();
+            test_ratings_per_proc[proc] += test_nnz(i);
         }
 
-        int max_nnz = *std::max_element(nnz_per_proc.begin(), nnz_per_proc.end());
-        int min_nnz = *std::min_element(nnz_per_proc.begin(), nnz_per_proc.end());
-        int avg_nnz = nnz() / nprocs;
+        long max_nnz = *std::max_element(nnz_per_proc.begin(), nnz_per_proc.end());
+        long min_nnz = *std::min_element(nnz_per_proc.begin(), nnz_per_proc.end());
+        long avg_nnz = nnz() / nprocs;
 
         int max_items = *std::max_element(items_per_proc.begin(), items_per_proc.end());
         int min_items = *std::min_element(items_per_proc.begin(), items_per_proc.end());
@@ -168,7 +165,7 @@ void Sys::assign(Sys &other)
                     << "\t(" << max_work << " <-> " << avg_work << " <-> " << min_work << ")\n\n";
 
         Sys::cout() << name << ": train nnz:\t" << nnz_per_proc[procid] << " / " << nnz() << "\n";
-        Sys::cout() << name << ": test nnz:\t" << test_ratings_per_proc[procid] << " / " << nnz() << "\n";
+        Sys::cout() << name << ": test nnz:\t" << test_ratings_per_proc[procid] << " / " << T->nonZeros() << "\n";
         Sys::cout() << name << ": items:\t" << items_per_proc[procid] << " / " << num() << "\n";
         Sys::cout() << name << ": work:\t" << work_per_proc[procid] << " / " << total_work << "\n";
     };
@@ -188,7 +185,10 @@ void Sys::assign(Sys &other)
     unsigned pos = 0;
     Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(num());
     for(auto p: proc_to_item) for(auto i: p) perm.indices()(pos++) = i;
-    auto oldT = T;
+#ifndef NDEBUG
+    std::vector<int> old_test_nnz(num());
+    for(int i=0; i<num(); ++i) old_test_nnz[i] = test_nnz(i);
+#endif
 
     permuteCols(perm, other);
 
@@ -199,7 +199,7 @@ void Sys::assign(Sys &other)
 
 #ifndef NDEBUG
     int j = 0;
-    for(auto i : proc_to_item.at(0)) assert(T.col(j++).nonZeros() == oldT.col(i).nonZeros());
+    for(auto i : proc_to_item.at(0)) assert(test_nnz(j++) == old_test_nnz[i]);
 #endif
 
     Sys::cout() << name << " domain:" << std::endl;
@@ -223,8 +223,8 @@ void Sys::update_conn(Sys& other)
     conn_map.resize(num());
     for (int k=0; k<num(); ++k) {
         std::bitset<max_procs> &bm = conn_map[k];
-        for (SparseMatrixD::InnerIterator it(M,k); it; ++it) bm.set(other.proc(it.row()));
-        for (SparseMatrixD::InnerIterator it(Pavg,k); it; ++it) bm.set(other.proc(it.row()));
+        for (RatingMatrix::InnerIterator it(M,k); it; ++it) bm.set(other.proc(it.row()));
+        for (TestMatrix::InnerIterator it(*T,k,T_by_row); it; ++it) bm.set(other.proc(it.row()));
         bm.reset(proc(k)); // not to self
         tot += bm.count();
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+/*
+ * Microbenchmark for the K x K systems in Sys::sample:
+ * Eigen LLT versus the unrolled SmallChol kernels, for the full Cholesky
+ * path (compute + solves) and the rank update path (rank updates + solves)
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include <Eigen/Dense>
+
+#include "smallchol.h"
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Eigen LLT with a precomputed factor, as in Sys::sample
+template<typename MatrixType>
+struct PrecomputedLLT : public Eigen::LLT<MatrixType>
+{
+    void operator=(const MatrixType &m) { this->m_matrix = m; this->m_isInitialized = true; this->m_info = Eigen::Success; }
+};
+
+template<int K>
+static void bench(int nreps)
+{
+    typedef Eigen::Matrix<double, K, K> MatrixNNd;
+    typedef Eigen::Matrix<double, K, 1> VectorNd;
+    const int nupdates = 16;
+
+    MatrixNNd B = MatrixNNd::Random();
+    MatrixNNd A = B * B.transpose() + K * MatrixNNd::Identity();
+    MatrixNNd L0 = A.llt().matrixL();
+    Eigen::Matrix<double, K, nupdates> V = Eigen::Matrix<double, K, nupdates>::Random();
+    VectorNd b = VectorNd::Random();
+
+    VectorNd x_eigen, x_small;
+    double t_eigen = 1e30, t_small = 1e30, start;
+    double check = 0;
+    const int ntimes = 5; // best of
+
+    // full path: factorize A, then L \ b and L^T \ b
+    for (int t = 0; t < ntimes; ++t)
+    {
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            Eigen::LLT<MatrixNNd> llt(A);
+            x_eigen = b;
+            llt.matrixL().solveInPlace(x_eigen);
+            llt.matrixU().solveInPlace(x_eigen);
+            check += x_eigen(0);
+        }
+        t_eigen = std::min(t_eigen, now() - start);
+
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            MatrixNNd L = A;
+            SmallChol<K>::compute(L.data());
+            x_small = b;
+            SmallChol<K>::solve_lower(L.data(), x_small.data());
+            SmallChol<K>::solve_upper(L.data(), x_small.data());
+            check += x_small(0);
+        }
+        t_small = std::min(t_small, now() - start);
+    }
+
+    std::printf("K=%3d  %-6s eigen %8.1f ns  small %8.1f ns  speedup %5.2fx  %s\n", K, "full",
+                1e9 * t_eigen / nreps, 1e9 * t_small / nreps, t_eigen / t_small,
+                (x_eigen - x_small).norm() < 1e-10 * x_eigen.norm() ? "ok" : "MISMATCH");
+
+    // rank update path: nupdates rank-one updates of L0, then the solves
+    t_eigen = t_small = 1e30;
+    for (int t = 0; t < ntimes; ++t)
+    {
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            PrecomputedLLT<MatrixNNd> llt;
+            llt = L0;
+            for (int u = 0; u < nupdates; ++u) llt.rankUpdate(V.col(u), 1.0);
+            x_eigen = b;
+            llt.matrixL().solveInPlace(x_eigen);
+            llt.matrixU().solveInPlace(x_eigen);
+            check += x_eigen(0);
+        }
+        t_eigen = std::min(t_eigen, now() - start);
+
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            MatrixNNd L = L0;
+            for (int u = 0; u < nupdates; ++u)
+            {
+                VectorNd v = V.col(u);
+                SmallChol<K>::rank_update(L.data(), v.data());
+            }
+            x_small = b;
+            SmallChol<K>::solve_lower(L.data(), x_small.data());
+            SmallChol<K>::solve_upper(L.data(), x_small.data());
+            check += x_small(0);
+        }
+        t_small = std::min(t_small, now() - start);
+    }
+
+    std::printf("K=%3d  %-6s eigen %8.1f ns  small %8.1f ns  speedup %5.2fx  %s\n", K, "rank",
+                1e9 * t_eigen / nreps, 1e9 * t_small / nreps, t_eigen / t_small,
+                (x_eigen - x_small).norm() < 1e-10 * x_eigen.norm() ? "ok" : "MISMATCH");
+
+    if (check == 42) std::printf("\n"); // keeps the loops
+}
+
+int main()
+{
+    bench<8>(40000);
+    bench<10>(40000);
+    bench<16>(20000);
+    bench<20>(10000);
+    bench<32>(4000);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+/*
+ * Microbenchmark for the Gram accumulation in Sys::sample:
+ * the original scalar upper-part loop versus the gather+SYRK tiles
+ * and the gram_accumulate kernels
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "gram.h"
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the loop used by Sys::sample before gram_accumulate
+template<int K>
+static void calc_upper_part(Eigen::Matrix<double, K, K> &m, const Eigen::Matrix<double, K, 1> &v)
+{
+    for (int j = 0; j < K; j++)
+        for (int i = 0; i <= j; i++)
+            m(i, j) = m(i, j) + v[j] * v[i];
+}
+
+template<int K>
+static void bench(int nitems, int nratings, int nreps)
+{
+    typedef Eigen::Matrix<double, K, K> MatrixNNd;
+    typedef Eigen::Matrix<double, K, 1> VectorNd;
+
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> pick(0, nitems - 1);
+    const int ld = gram_padded(K);
+    Eigen::MatrixXd in = Eigen::MatrixXd::Zero(ld, nitems); // zero padded columns, as Sys::items()
+    in.topRows(K).setRandom();
+    std::vector<int> idx(nratings);
+    std::vector<double> val(nratings);
+    for (int j = 0; j < nratings; ++j) { idx[j] = pick(gen); val[j] = 1 + j % 5; }
+
+    const double mean = 3.0, alpha = 2.0;
+    double check_ref = 0, check_new = 0;
+
+    // reference
+    double start = now();
+    for (int r = 0; r < nreps; ++r)
+    {
+        MatrixNNd MM(MatrixNNd::Zero());
+        VectorNd rr(VectorNd::Zero());
+        for (int j = 0; j < nratings; ++j)
+        {
+            VectorNd col = in.col(idx[j]).head(K);
+            calc_upper_part<K>(MM, col);
+            rr.noalias() += col * ((val[j] - mean) * alpha);
+        }
+        check_ref += MM(0, K - 1) + rr(K - 1);
+    }
+    double t_ref = now() - start;
+
+    std::printf("K=%3d  %-8s %8.2f Mratings/s\n", K, "loop", 1e-6 * nratings * nreps / t_ref);
+
+    // gather + SYRK, as in the medium path
+    {
+        const int tile = 64;
+        Eigen::Matrix<double, K, tile> T;
+        Eigen::Matrix<double, tile, 1> w;
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            MatrixNNd MM(MatrixNNd::Zero());
+            VectorNd rr(VectorNd::Zero());
+            for (int j = 0; j < nratings; j += tile)
+            {
+                int n = std::min(tile, nratings - j);
+                for (int c = 0; c < n; ++c) { T.col(c) = in.col(idx[j+c]).head(K); w(c) = (val[j+c] - mean) * alpha; }
+                MM.template selfadjointView<Eigen::Lower>().rankUpdate(T.leftCols(n));
+                rr.noalias() += T.leftCols(n) * w.head(n);
+            }
+            check_new += MM(K - 1, 0) + rr(K - 1);
+        }
+        double t = now() - start;
+        std::printf("K=%3d  %-8s %8.2f Mratings/s  speedup %5.2fx\n", K, "syrk", 1e-6 * nratings * nreps / t, t_ref / t);
+        check_new = 0;
+    }
+
+    for (const char *name : { "scalar", "avx2", "avx512" })
+    {
+        if (!gram_select_kernel(name)) continue;
+
+        std::vector<double> packed(gram_packed_size(K));
+        VectorNd rr;
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            std::fill(packed.begin(), packed.end(), 0.0);
+            rr.setZero();
+            gram_accumulate(K, in.data(), ld, idx.data(), val.data(), 0, nratings, mean, alpha, packed.data(), rr.data());
+            check_new += packed[gram_packed_size(K - 1)] + rr(K - 1); // element (0, K-1)
+        }
+        double t = now() - start;
+
+        std::printf("K=%3d  %-8s %8.2f Mratings/s  speedup %5.2fx  %s\n", K, name,
+                    1e-6 * nratings * nreps / t, t_ref / t,
+                    std::abs(check_new - check_ref) < 1e-6 * std::abs(check_ref) + 1e-6 ? "ok" : "MISMATCH");
+        check_new = 0;
+    }
+}
+
+int main()
+{
+    const int nitems = 100000;
+    const int nratings = 5000;
+
+    bench<10>(nitems, nratings, 400);
+    bench<16>(nitems, nratings, 400);
+    bench<30>(nitems, nratings, 100);
+    bench<32>(nitems, nratings, 100);
+    bench<64>(nitems, nratings, 30);
+    bench<100>(nitems, nratings, 12);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+/*
+ * Microbenchmark for the normal deviates of Sys::sample:
+ * std::normal_distribution one at a time versus randn_fill, per vector of K
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "rng.h"
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void bench(int K, int nreps)
+{
+    Philox g(42);
+    std::vector<double> x(K);
+    double t_std = 1e30, t_fill = 1e30, start;
+    double sum = 0, sum2 = 0, check = 0;
+    const int ntimes = 5; // best of
+
+    for (int t = 0; t < ntimes; ++t)
+    {
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            g.seek(r, 0, 0);
+            for (int i = 0; i < K; ++i)
+            {
+                std::normal_distribution<> nd;
+                x[i] = nd(g);
+            }
+            check += x[0];
+        }
+        t_std = std::min(t_std, now() - start);
+
+        start = now();
+        for (int r = 0; r < nreps; ++r)
+        {
+            g.seek(r, 0, 0);
+            randn_fill(g, x.data(), K);
+            for (int i = 0; i < K; ++i) { sum += x[i]; sum2 += x[i] * x[i]; }
+        }
+        t_fill = std::min(t_fill, now() - start);
+    }
+
+    const double n = (double)ntimes * nreps * K;
+    std::printf("K=%3d  std %7.1f ns  fill %7.1f ns  speedup %5.2fx  mean %+.4f var %.4f\n", K,
+                1e9 * t_std / nreps, 1e9 * t_fill / nreps, t_std / t_fill, sum / n, sum2 / n);
+
+    if (check == 42) std::printf("\n"); // keeps the loops
+}
+
+int main()
+{
+    bench(10, 200000);
+    bench(16, 200000);
+    bench(32, 100000);
+    bench(100, 40000);
+
+    return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+/*
+ * Microbenchmark for the predictions of Sys::predict:
+ * the per-nonzero dot product loop versus the blocked sddmm kernel
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "sddmm.h"
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+template<int K, typename T>
+static void bench(int nrows, int ncols, long nnz, int nreps)
+{
+    typedef Eigen::Matrix<double, K, 1> VectorNd;
+    typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic> Items;
+
+    // random pattern with sorted rows in each column, as Sys::M and TestMatrix
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> pick_row(0, nrows - 1), pick_col(0, ncols - 1);
+    std::vector<std::vector<int>> cols(ncols);
+    for (long j = 0; j < nnz; ++j) cols[pick_col(gen)].push_back(pick_row(gen));
+    std::vector<SparseIndex> ptr(ncols + 1, 0);
+    std::vector<int> idx;
+    for (int c = 0; c < ncols; ++c)
+    {
+        std::sort(cols[c].begin(), cols[c].end());
+        idx.insert(idx.end(), cols[c].begin(), cols[c].end());
+        ptr[c + 1] = idx.size();
+    }
+
+    const int ld = (K + 3) / 4 * 4; // padded, as Sys::items()
+    Items a = Items::Zero(ld, ncols), b = Items::Zero(ld, nrows);
+    a.topRows(K).setRandom();
+    b.topRows(K).setRandom();
+    std::vector<double> out_ref(nnz), out(nnz);
+
+    double t_ref = 1e30, t_new = 1e30;
+    for (int r = 0; r < nreps; ++r)
+    {
+        // the loop of Sys::predict before sddmm
+        double start = now();
+        for (int c = 0; c < ncols; ++c)
+        {
+            const VectorNd m = a.col(c).template head<K>().template cast<double>();
+            for (long p = ptr[c]; p < ptr[c + 1]; ++p)
+            {
+                const VectorNd u = b.col(idx[p]).template head<K>().template cast<double>();
+                out_ref[p] = m.dot(u);
+            }
+        }
+        t_ref = std::min(t_ref, now() - start);
+
+        start = now();
+        sddmm(K, a.data(), ld, b.data(), ld, nrows, ptr.data(), idx.data(), 0, ncols, out.data());
+        t_new = std::min(t_new, now() - start);
+    }
+
+    double err = 0;
+    for (long p = 0; p < nnz; ++p) err = std::max(err, std::abs(out[p] - out_ref[p]));
+
+    // bytes: the vector of b of each nonzero and its index, the output
+    const double bytes = nnz * (K * sizeof(T) + sizeof(int) + sizeof(double));
+    std::printf("K=%3d %-6s  loop %6.2f ns/nnz  sddmm %6.2f ns/nnz (%5.2f GB/s)  speedup %5.2fx  max err %.1e\n",
+                K, sizeof(T) == 4 ? "float" : "double", 1e9 * t_ref / nnz, 1e9 * t_new / nnz,
+                bytes / t_new / 1e9, t_ref / t_new, err);
+}
+
+int main()
+{
+    // a movielens-like shape, and many more rows than fit in cache
+    bench<16, double>(70000, 10000, 4000000, 5);
+    bench<32, double>(70000, 10000, 4000000, 5);
+    bench<64, double>(70000, 10000, 2000000, 5);
+    bench<32, float>(70000, 10000, 4000000, 5);
+    bench<32, double>(1000000, 20000, 4000000, 5);
+
+    return 0;
+}
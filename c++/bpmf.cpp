@@ -13,6 +13,9 @@
 
 #include "io.h"
 #include "bpmf.h"
+#include "gram.h"
+#include "tune.h"
+#include "convergence.h"
 
 using namespace std;
 using namespace Eigen;
@@ -41,20 +44,38 @@ using namespace Eigen;
 
 void usage() 
 {
-    std::cout << "Usage: bpmf -n <MTX> -p <MTX> [-o DIR/] [-i N] [-b N] [-krv] [-t N] [-m MTX,MTX] [-l MTX,MTX]\n"
+    std::cout << "Usage: bpmf -n <MTX> [-p <MTX>] [-o DIR/] [-i N] [-b N] [-B R] [-X N] [-d N] [-c FILE] [-s N] [-krvfePRL] [-E N] [-S F] [-g N] [-w N] [-t N] [-m MTX,MTX] [-l MTX,MTX]\n"
                 << "\n"
                 << "Paramaters: \n"
                 << "  -n MTX: Training input data\n"
-                << "  -p MTX: Test input data\n"
+                << "  [-p MTX]: Test input data, optional with -L\n"
                 << "  [-o DIR]: Output directory for model and predictions\n"
                 << "  [-i N]: Number of total iterations\n"
                 << "  [-b N]: Number of burnin iterations\n"
+                << "  [-B R]: End the burnin once the split-R-hat of all traces is below R,\n"
+                << "          after at least -b iterations\n"
+                << "  [-X N]: Stop once all traces have N effective samples after the burnin,\n"
+                << "          after at most -i iterations\n"
                 << "  [-a F]: Noise precision (alpha)\n"
+                << "  [-d N]: Number of latent dimensions (default " << BPMF_NUMLATENT << ")\n"
+                << "  [-s N]: Random seed (default 0)\n"
                 << "\n"
                 << "  [-k]: Do not optimize item to node assignment\n"
                 << "  [-r]: Redirect stdout to file\n"
                 << "  [-v]: Output all samples\n"
                 << "  [-t N]: Number of OpenMP threads to use.\n"
+                << "  [-g N]: Number of items per chunk of the sampling loop (default 1)\n"
+                << "  [-f]: Sample the items with the largest cost first\n"
+                << "  [-w N]: Sample the items with less than N ratings " << BPMF_SIMD_WIDTH << " at a time (default 0 = off)\n"
+                << "  [-e]: Score the test ratings of each user when it is sampled, not in a separate pass\n"
+                << "  [-E N]: Compute the RMSE of all test ratings every N iterations (default 1)\n"
+                << "  [-S F]: In between, compute it on a random fraction F of them\n"
+                << "  [-L]: Print the training RMSE and log-likelihood every iteration\n"
+                << "  [-P]: Pin the OpenMP threads to the cpus, one per cpu\n"
+                << "  [-R]: Copy the items read while sampling to each NUMA node (needs BPMF_NUMA)\n"
+                << "  [-c FILE]: Read the sampling breakpoints from FILE, or tune them and write FILE\n"
+                << "             if it does not exist or was tuned for another -d or -t.\n"
+                << "             Without -n and -p, only tunes.\n"
                 << "\n"
                 << "  [-l MTX,MTX]: propagated posterior mu and Lambda matrices for U\n"
                 << "  [-m MTX,MTX]: propagated posterior mu and Lambda matrices for V\n"
@@ -73,23 +94,32 @@ int main(int argc, char *argv[])
     int ch;
     string fname, probename;
     string mname, lname;
+    string tune_profile;
     int nthrds = -1;
     bool redirect = false;
+    bool pin = false;
+    bool fused_eval = false;
+    double rhat_tol = 0.0, ess_target = 0.0;
     Sys::nsims = 20;
     Sys::burnin = 5;
     Sys::grain_size = 1;
+    uint64_t seed = 0;
     
  
-    while((ch = getopt(argc, argv, "krvn:t:p:i:b:g:w:u:v:o:s:m:l:a:d:")) != -1)
+    while((ch = getopt(argc, argv, "krvfePRLE:S:B:X:n:t:p:i:b:g:w:u:v:o:s:m:l:a:d:c:")) != -1)
     {
         switch(ch)
         {
             case 'i': Sys::nsims = atoi(optarg); break;
             case 'b': Sys::burnin = atoi(optarg); break;
+            case 'B': rhat_tol = atof(optarg); break;
+            case 'X': ess_target = atof(optarg); break;
             case 'g': Sys::grain_size = atoi(optarg); break;
             case 't': nthrds = atoi(optarg); break;
             case 'a': Sys::alpha = atof(optarg); break;
-            case 'd': assert(num_latent == atoi(optarg)); break;
+            case 'd': num_latent = atoi(optarg); break;
+            case 'c': tune_profile = optarg; break;
+            case 's': seed = strtoull(optarg, 0, 10); break;
             case 'n': fname = optarg; break;
             case 'p': probename = optarg; break;
 
@@ -102,12 +132,23 @@ int main(int argc, char *argv[])
             case 'r': redirect = true; break;
             case 'k': Sys::permute = false; break;
             case 'v': Sys::verbose = true; break;
+            case 'f': Sys::sort_by_cost = true; break;
+            case 'w': Sys::breakpoint_batch = atoi(optarg); break;
+            case 'e': fused_eval = true; break;
+            case 'E': Sys::eval_every = atoi(optarg); break;
+            case 'S': Sys::eval_fraction = atof(optarg); break;
+            case 'L': Sys::train_monitor = true; break;
+            case 'P': pin = true; break;
+            case 'R': Sys::replicate_items = true; break;
             case '?':
             case 'h': 
             default : usage(); Sys::Abort(1);
         }
     }
 
+    // the Woodbury path is cheaper when there are less ratings than latent dimensions
+    if (Sys::breakpoint0 < 0 || Sys::breakpoint0 > num_latent) Sys::breakpoint0 = num_latent;
+
     if (Sys::nprocs >1 || redirect) {
         std::stringstream ofname;
         ofname << "bpmf_" << Sys::procid << ".out";
@@ -116,14 +157,41 @@ int main(int argc, char *argv[])
         Sys::os = &std::cout;
     }
 
-    if (fname.empty() || probename.empty()) { 
+    if (((fname.empty() || (probename.empty() && !Sys::train_monitor)) && tune_profile.empty()) || num_latent <= 0 || Sys::grain_size == 0
+            || Sys::eval_every <= 0 || Sys::eval_fraction < 0.0 || Sys::eval_fraction > 1.0) { 
         usage();
         Sys::Abort(1);
     }
 
+    threads::init(nthrds);
+    if (pin && !threads::pin()) Sys::cout() << "Ignoring -P: cannot set the thread affinity" << endl;
+    if (fused_eval && Sys::eval_fraction > 0.0) {
+        Sys::cout() << "Ignoring -S with -e" << endl;
+        Sys::eval_fraction = 0.0;
+    }
+#ifndef BPMF_NUMA
+    if (Sys::replicate_items) Sys::cout() << "Ignoring -R: built without BPMF_NUMA" << endl;
+#endif
+    rng_seed(seed);
+
+    // every process tunes for its own node, only the first one writes the profile
+    if (!tune_profile.empty() && !read_tune_profile(tune_profile)) {
+        tune_breakpoints();
+        if (Sys::procid == 0) write_tune_profile(tune_profile);
+    }
+
+    if (fname.empty()) {
+        Sys::Finalize();
+        return 0;
+    }
+
 
     SYS movies("movs", fname, probename);
-    SYS users("users", movies.M, movies.Pavg);
+    SYS users("users", movies.M, movies.T);
+    users.predict_in_sample = fused_eval;
+    Sys *eval = fused_eval ? (Sys *)&users : (Sys *)&movies; // has the last RMSE
+    Sys *eval_other = fused_eval ? (Sys *)&movies : (Sys *)&users;
+    const bool has_test = movies.T->nonZeros() > 0;
 
     movies.add_prop_posterior(mname);
     users.add_prop_posterior(lname);
@@ -143,8 +211,6 @@ int main(int argc, char *argv[])
     movies.build_conn(users);
     assert(movies.nnz() == users.nnz());
 
-    threads::init(nthrds);
-
     long double average_items_sec = .0;
     long double average_ratings_sec = .0;
     
@@ -157,14 +223,34 @@ int main(int argc, char *argv[])
     if(Sys::procid == 0)
     {
         Sys::cout() << "num_latent: " << num_latent<<endl;
+        Sys::cout() << "gram kernel: " << gram_kernel_name() << endl;
         Sys::cout() << "nprocs: " << Sys::nprocs << endl;
         Sys::cout() << "nthrds: " << threads::get_max_threads() << endl;
+        Sys::cout() << "breakpoints: " << Sys::breakpoint0 << " " << Sys::breakpoint1 << " " << Sys::breakpoint2 << endl;
+        Sys::cout() << "batch breakpoint: " << Sys::breakpoint_batch << endl;
         Sys::cout() << "nsims: " << Sys::nsims << endl;
         Sys::cout() << "burnin: " << Sys::burnin << endl;
+        if (rhat_tol > 0.0) Sys::cout() << "burnin split-R-hat tolerance: " << rhat_tol << endl;
+        if (ess_target > 0.0) Sys::cout() << "effective samples to stop: " << ess_target << endl;
         Sys::cout() << "grain_size: " << Sys::grain_size << endl;
+        Sys::cout() << "sort_by_cost: " << Sys::sort_by_cost << endl;
+        Sys::cout() << "fused eval: " << fused_eval << endl;
+        Sys::cout() << "eval every: " << Sys::eval_every << endl;
+        Sys::cout() << "eval fraction: " << Sys::eval_fraction << endl;
+        Sys::cout() << "train monitor: " << Sys::train_monitor << endl;
+        Sys::cout() << "pinned threads: " << pin << endl;
+        Sys::cout() << "replicated items: " << Sys::replicate_items << endl;
         Sys::cout() << "alpha: " << Sys::alpha << endl;
+        Sys::cout() << "seed: " << seed << endl;
     }
 
+    // with -B the burnin lasts until the traces are stationary, -b is the minimum
+    Convergence conv;
+    const bool adaptive = rhat_tol > 0.0 || ess_target > 0.0;
+    const int min_burnin = Sys::burnin;
+    bool burnin_pending = rhat_tol > 0.0;
+    if (burnin_pending) Sys::burnin = Sys::nsims;
+
     Sys::sync();
 
     auto begin = tick();
@@ -173,30 +259,93 @@ int main(int argc, char *argv[])
         BPMF_COUNTER("main");
         auto start = tick();
 
+        // the first iteration sizes the buffers, the next ones should not allocate
+        const bool no_malloc = i > 0 && num_latent_is_fixed();
+
+        // all test ratings at the end and every eval_every iterations,
+        // the other samples are kept for then
+        const bool exact_eval = (i + 1) % Sys::eval_every == 0 || i == Sys::nsims - 1;
+        users.predict_in_sample = fused_eval && exact_eval;
+
         movies.sample_hp();
-        { BPMF_COUNTER("movies"); movies.sample(users); }
+        { BPMF_COUNTER("movies"); BPMF_NO_MALLOC("movies", no_malloc); movies.sample(users); }
         users.sample_hp();
-        { BPMF_COUNTER("users");  users.sample(movies); }
+        { BPMF_COUNTER("users");  BPMF_NO_MALLOC("users", no_malloc);  users.sample(movies); }
 
+        if (has_test && !exact_eval)
+        {
+            BPMF_COUNTER("eval");
+            eval->defer_predict(*eval_other);
+        }
+        else if (has_test && !fused_eval)
         { 
             BPMF_COUNTER("eval");
             movies.predict(users); 
-            users.predict(movies); 
+        }
+
+        if (Sys::train_monitor)
+        {
+            BPMF_COUNTER("train");
+            eval->train_eval(*eval_other);
         }
 
         auto stop = tick();
         double items_per_sec = (users.num() + movies.num()) / (stop - start);
         double ratings_per_sec = (users.nnz()) / (stop - start);
-        movies.print(items_per_sec, ratings_per_sec, sqrt(users.aggr_norm()), sqrt(movies.aggr_norm()));
+        eval->print(items_per_sec, ratings_per_sec, sqrt(users.aggr_norm()), sqrt(movies.aggr_norm()));
         average_items_sec += items_per_sec;
         average_ratings_sec += ratings_per_sec;
 
         if (Sys::verbose)
         {
             users.bcast();
-            write_matrix(Sys::odirname + "/U-" + std::to_string(i) + ".ddm", users.items());
+            write_matrix(Sys::odirname + "/U-" + std::to_string(i) + ".ddm", users.items().cast<double>());
             movies.bcast();
-            write_matrix(Sys::odirname + "/V-" + std::to_string(i) + ".ddm", movies.items());
+            write_matrix(Sys::odirname + "/V-" + std::to_string(i) + ".ddm", movies.items().cast<double>());
+        }
+
+        // the RMSEs are local to each process: with more than one, only the
+        // traces that are the same everywhere decide
+        if (adaptive)
+        {
+            conv.add("FU", i, sqrt(users.aggr_norm()));
+            conv.add("FM", i, sqrt(movies.aggr_norm()));
+            conv.add("mu U", i, users.hp.mu.norm());
+            conv.add("mu V", i, movies.hp.mu.norm());
+            conv.add("Lambda U", i, users.hp.LambdaF.trace());
+            conv.add("Lambda V", i, movies.hp.LambdaF.trace());
+            if (Sys::nprocs == 1 && eval->rmse_iter == i && eval->rmse_ci == 0.0) conv.add("RMSE", i, eval->rmse);
+            if (Sys::nprocs == 1 && eval->train_iter == i) conv.add("train RMSE", i, eval->train_rmse);
+
+            std::string trace;
+            if (burnin_pending)
+            {
+                const double rhat = conv.max_rhat(i, trace);
+                if (i + 1 >= min_burnin && rhat > 0.0 && rhat < rhat_tol)
+                {
+                    Sys::cout() << "Burnin ends after iteration " << i << ": largest split-R-hat "
+                                << rhat << " (" << trace << ")" << endl;
+                    burnin_pending = false;
+                }
+                else if (i + 1 >= std::max(min_burnin, Sys::nsims / 2))
+                {
+                    Sys::cout() << "Burnin ends after iteration " << i << ", half of -i: split-R-hat still "
+                                << rhat << " (" << trace << ")" << endl;
+                    burnin_pending = false;
+                }
+                if (!burnin_pending) Sys::burnin = i + 1;
+            }
+            else if (ess_target > 0.0)
+            {
+                const double ess = conv.min_ess(Sys::burnin, trace);
+                if (ess >= ess_target)
+                {
+                    Sys::cout() << "Stopping after iteration " << i << ": smallest effective sample size "
+                                << ess << " (" << trace << ")" << endl;
+                    if (has_test && !exact_eval) eval->flush_predict(*eval_other);
+                    break;
+                }
+            }
         }
     }
 
@@ -210,6 +359,7 @@ int main(int argc, char *argv[])
         users.bcast();
         movies.bcast();
         movies.predict(users, true);
+        eval = &movies;
 
         // restore original order
         users.unpermuteCols(movies);
@@ -217,23 +367,18 @@ int main(int argc, char *argv[])
 
         if (Sys::procid == 0) {
             // sparse
-            write_matrix(Sys::odirname + "/Pavg.sdm", movies.Pavg);
-            write_matrix(Sys::odirname + "/Pm2.sdm", movies.Pm2);
+            write_matrix(Sys::odirname + "/Pavg.sdm", movies.T->sparse(movies.T->Pavg, movies.T_by_row));
+            write_matrix(Sys::odirname + "/Pm2.sdm", movies.T->sparse(movies.T->Pm2, movies.T_by_row));
 
             // dense
-            users.finalize_mu_lambda();
-            write_matrix(Sys::odirname + "/U-mu.ddm", users.aggrMu);
-            write_matrix(Sys::odirname + "/U-Lambda.ddm", users.aggrLambda);
-
-            movies.finalize_mu_lambda();
-            write_matrix(Sys::odirname + "/V-mu.ddm", movies.aggrMu);
-            write_matrix(Sys::odirname + "/V-Lambda.ddm", movies.aggrLambda);
+            users.finalize_mu_lambda(Sys::odirname + "/U-mu.ddm", Sys::odirname + "/U-Lambda.ddm");
+            movies.finalize_mu_lambda(Sys::odirname + "/V-mu.ddm", Sys::odirname + "/V-Lambda.ddm");
         }
     }
 
     if (Sys::procid == 0) {
         Sys::cout() << "Total time: " << elapsed <<endl <<flush;
-        Sys::cout() << "Final Avg RMSE: " << movies.rmse_avg <<endl <<flush;
+        if (eval->rmse_iter >= 0) Sys::cout() << "Final Avg RMSE: " << eval->rmse_avg <<endl <<flush;
         Sys::cout() << "Average items/sec: " << average_items_sec / movies.iter << endl <<flush;
         Sys::cout() << "Average ratings/sec: " << average_ratings_sec / movies.iter << endl <<flush;
     }
@@ -251,11 +396,11 @@ void Sys::bcast()
 {
     for(int i = 0; i < num(); i++) {
 #ifdef BPMF_MPI_COMM
-        MPI_Bcast(items().col(i).data(), num_latent, MPI_DOUBLE, proc(i), MPI_COMM_WORLD);
-        if (aggrMu.nonZeros())
-            MPI_Bcast(aggrMu.col(i).data(), num_latent, MPI_DOUBLE, proc(i), MPI_COMM_WORLD);
-        if (aggrLambda.nonZeros())
-            MPI_Bcast(aggrLambda.col(i).data(), num_latent*num_latent, MPI_DOUBLE, proc(i), MPI_COMM_WORLD);
+        MPI_Bcast(items().col(i).data(), num_latent, BPMF_MPI_ITEM, proc(i), MPI_COMM_WORLD);
+        if (aggrMu.size())
+            MPI_Bcast(aggrMu.col(i).data(), aggrMu.rows(), BPMF_MPI_AGGR, proc(i), MPI_COMM_WORLD);
+        if (aggrLambda.size())
+            MPI_Bcast(aggrLambda.col(i).data(), aggrLambda.rows(), BPMF_MPI_AGGR, proc(i), MPI_COMM_WORLD);
 #else
         assert(Sys::nprocs == 1);
 #endif
@@ -263,18 +408,32 @@ void Sys::bcast()
 }
 
 
-void Sys::finalize_mu_lambda()
+//
+// writes the mean and the precision of the samples of each item,
+// the precision as packed upper triangle, one block of items at a time
+//
+void Sys::finalize_mu_lambda(std::string mu_fname, std::string lambda_fname)
 {
-    assert(aggrLambda.nonZeros());
-    assert(aggrMu.nonZeros());
-    // calculate real mu and Lambda
-    for(int i = 0; i < num(); i++) {
-        int nsamples = Sys::nsims - Sys::burnin;
-        auto sum = aggrMu.col(i);
-        auto prod = Eigen::Map<MatrixNNd>(aggrLambda.col(i).data());
-        MatrixNNd cov = (prod - (sum * sum.transpose() / nsamples)) / (nsamples - 1);
-        MatrixNNd prec = cov.inverse(); // precision = covariance^-1
-        aggrLambda.col(i) = Eigen::Map<Eigen::VectorXd>(prec.data(), num_latent * num_latent);
-        aggrMu.col(i) = sum / nsamples;
-    }
+    assert(aggrLambda.size());
+    assert(aggrMu.size());
+    const int nsamples = iter + 1 - Sys::burnin;
+
+    write_dense_float64_bin(mu_fname, num_latent, num(), [this](std::uint64_t from, Eigen::MatrixXd &X) {
+        X = aggrMu.middleCols(from, X.cols()).cast<double>();
+    });
+
+    write_dense_float64_bin(lambda_fname, aggrLambda.rows(), num(), [this, nsamples](std::uint64_t from, Eigen::MatrixXd &X) {
+        #pragma omp parallel for schedule(guided)
+        for(int j = 0; j < X.cols(); j++) {
+            Eigen::MatrixXd cov(num_latent, num_latent);
+            const AggrScalar *p = aggrLambda.col(from + j).data();
+            for(int c = 0; c < num_latent; ++c)
+                for(int r = 0; r <= c; ++r, ++p) cov(r, c) = cov(c, r) = *p / (nsamples - 1);
+
+            Eigen::MatrixXd prec = cov.inverse(); // precision = covariance^-1
+            double *q = X.col(j).data();
+            for(int c = 0; c < num_latent; ++c)
+                for(int r = 0; r <= c; ++r) *q++ = prec(r, c);
+        }
+    });
 }
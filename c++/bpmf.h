@@ -7,7 +7,9 @@
 #define BPMF_H
 
 #include <bitset>
+#include <cstdlib>
 #include <functional>
+#include <memory>
 
 #define EIGEN_RUNTIME_NO_MALLOC 1
 #define EIGEN_DONT_PARALLELIZE 1
@@ -16,62 +18,143 @@
 #include "Eigen/Sparse"
 
 #include "counters.h"
+#include "gram.h"
+#include "ratings.h"
+#include "rng.h"
 #include "thread_vector.h"
 
 #ifndef BPMF_NUMLATENT
-#error Define BPMF_NUMLATENT
+#define BPMF_NUMLATENT 16
 #endif
 
-const int num_latent = BPMF_NUMLATENT;
+//
+// Latent dimensions for which specialized fixed-size kernels are compiled in.
+// F(K, X) is expanded for each K; any other num_latent runs the generic
+// Eigen::Dynamic instantiation.
+//
+#ifndef BPMF_FOR_EACH_NUMLATENT
+#define BPMF_FOR_EACH_NUMLATENT(F, X) \
+    F(8, X) F(10, X) F(16, X) F(20, X) F(30, X) F(32, X) F(40, X) F(50, X) \
+    F(60, X) F(64, X) F(70, X) F(80, X) F(90, X) F(100, X) F(128, X)
+#endif
 
-typedef Eigen::SparseMatrix<double> SparseMatrixD;
-typedef Eigen::Matrix<double, num_latent, num_latent> MatrixNNd;
-typedef Eigen::Matrix<double, num_latent, Eigen::Dynamic> MatrixNXd;
-typedef Eigen::Matrix<double, num_latent, 1> VectorNd;
-typedef Eigen::Map<MatrixNXd, Eigen::Aligned> MapNXd;
-typedef Eigen::Map<Eigen::VectorXd, Eigen::Aligned> MapXd;
+// calls CALL(K) with the compile-time K that matches num_latent
+#define BPMF_NUMLATENT_CASE(K, CALL) case K: CALL(K); break;
+#define BPMF_DISPATCH_NUMLATENT(CALL) \
+    switch (num_latent) { \
+        BPMF_FOR_EACH_NUMLATENT(BPMF_NUMLATENT_CASE, CALL) \
+        default: CALL(Eigen::Dynamic); \
+    }
 
-void assert_same_struct(SparseMatrixD &A, SparseMatrixD &B);
+extern int num_latent;
 
-std::pair< VectorNd, MatrixNNd>
-CondNormalWishart(const int N, const MatrixNNd &C, const VectorNd &Um, const VectorNd &mu, const double kappa, const MatrixNNd &T, const int nu);
+// true if num_latent has a fixed-size instantiation, which does not allocate while sampling
+inline bool num_latent_is_fixed()
+{
+#define BPMF_IS_FIXED(K) return K != Eigen::Dynamic
+    BPMF_DISPATCH_NUMLATENT(BPMF_IS_FIXED)
+#undef BPMF_IS_FIXED
+}
 
-double randn(double);
-auto nrandn(int n) -> decltype( Eigen::VectorXd::NullaryExpr(n, std::ptr_fun(randn)) ); 
+// doubles per SIMD vector, the items are stored with their columns padded to a multiple
+#ifndef BPMF_SIMD_WIDTH
+#define BPMF_SIMD_WIDTH 4
+#endif
 
-inline auto nrandn() -> decltype( VectorNd::NullaryExpr(std::ptr_fun(randn)) ) { 
-    return VectorNd::NullaryExpr(std::ptr_fun(randn)); 
+// leading dimension of the items, the padding lanes are kept zero
+inline int num_latent_padded() { return (num_latent + BPMF_SIMD_WIDTH - 1) / BPMF_SIMD_WIDTH * BPMF_SIMD_WIDTH; }
+
+// scalar of the stored items: with -DBPMF_FLOAT_ITEMS the items are stored and their
+// Gram matrix MM and rr are accumulated in single precision, the K x K Cholesky and
+// the hyper-parameters stay in double
+#ifdef BPMF_FLOAT_ITEMS
+typedef float ItemScalar;
+#define BPMF_MPI_ITEM MPI_FLOAT
+#else
+typedef double ItemScalar;
+#define BPMF_MPI_ITEM MPI_DOUBLE
+#endif
+
+// scalar of the aggregated posterior (-o), -DBPMF_FLOAT_AGGR halves its memory
+#ifdef BPMF_FLOAT_AGGR
+typedef float AggrScalar;
+#define BPMF_MPI_AGGR MPI_FLOAT
+#else
+typedef double AggrScalar;
+#define BPMF_MPI_AGGR MPI_DOUBLE
+#endif
+
+template<int K> using MatrixNNd = Eigen::Matrix<double, K, K>;
+template<int K> using MatrixNXd = Eigen::Matrix<double, K, Eigen::Dynamic>;
+template<int K> using VectorNd = Eigen::Matrix<double, K, 1>;
+template<int K> using MapNXd = Eigen::Map<MatrixNXd<K>, Eigen::Aligned>;
+template<int K> using ConstMapNNd = Eigen::Map<const MatrixNNd<K>>;
+template<int K> using ConstMapNd = Eigen::Map<const VectorNd<K>>;
+template<int K> using MatrixNNi = Eigen::Matrix<ItemScalar, K, K>;
+template<int K> using VectorNi = Eigen::Matrix<ItemScalar, K, 1>;
+template<int K> using ItemsNXi = Eigen::Map<Eigen::Matrix<ItemScalar, K, Eigen::Dynamic>, Eigen::Aligned, Eigen::OuterStride<>>;
+template<int K> using PackedNd = Eigen::Matrix<double, K == Eigen::Dynamic ? Eigen::Dynamic : gram_packed_size(K), 1>;
+template<int K> using PackedNi = Eigen::Matrix<ItemScalar, K == Eigen::Dynamic ? Eigen::Dynamic : gram_packed_size(K), 1>;
+typedef Eigen::Map<Eigen::VectorXd, Eigen::Aligned> MapXd;
+
+template<int K>
+std::pair< VectorNd<K>, MatrixNNd<K> >
+CondNormalWishart(const int N, const MatrixNNd<K> &C, const VectorNd<K> &Um, const VectorNd<K> &mu, const double kappa, const MatrixNNd<K> &T, const int nu);
+
+double randn(double);
+Eigen::VectorXd nrandn(int n);
+
+// num_latent normal deviates in one call to randn_fill
+template<int K>
+inline VectorNd<K> nrandn() {
+    VectorNd<K> r(num_latent);
+    randn_fill(r.data(), num_latent);
+    return r;
 }
 
 inline double sqr(double x) { return x*x; }
 
+// storage for n items of num_latent_padded() ItemScalars, aligned to a cache line
+inline ItemScalar *alloc_items(int n)
+{
+    void *p = 0;
+    if (posix_memalign(&p, 64, sizeof(ItemScalar) * num_latent_padded() * n)) return 0;
+    return (ItemScalar *)p;
+}
+
 //
 // sampled hyper parameters for priors
 //
 struct HyperParams {
     // fixed params
     const int b0 = 2;
-    const int df = num_latent;
-    VectorNd mu0;
-    MatrixNNd WI;
+    const int df;
+    Eigen::VectorXd mu0;
+    Eigen::MatrixXd WI;
 
     // sampling output
-    VectorNd mu;
-    MatrixNNd LambdaF;
-    MatrixNNd LambdaU; // triangulated upper part
-    MatrixNNd LambdaL; // triangulated lower part
+    Eigen::VectorXd mu;
+    Eigen::MatrixXd LambdaF;
+    Eigen::MatrixXd LambdaU; // triangulated upper part
+    Eigen::MatrixXd LambdaL; // triangulated lower part
+    Eigen::VectorXd LambdaF_mu; // LambdaF * mu, prior term of each item
  
     // c'tor
     HyperParams()
+        : df(num_latent), 
+          mu0(Eigen::VectorXd::Zero(num_latent)),
+          WI(Eigen::MatrixXd::Identity(num_latent, num_latent))
     {
-        WI.setIdentity();
-        mu0.setZero();
     }
 
-    void sample(const int N, const  VectorNd &sum, const  MatrixNNd &cov) {
-        std::tie(mu, LambdaU) = CondNormalWishart(N, cov, sum / N, mu0, b0, WI, df);
-	LambdaF = LambdaU.triangularView<Eigen::Upper>().transpose() * LambdaU;
+    template<int K>
+    void sample(const int N, const  VectorNd<K> &sum, const  MatrixNNd<K> &cov) {
+        auto p = CondNormalWishart<K>(N, cov, sum / N, mu0, b0, WI, df);
+        mu = p.first;
+        LambdaU = p.second;
+	LambdaF = p.second.template triangularView<Eigen::Upper>().transpose() * p.second;
         LambdaL = LambdaU.transpose();
+        LambdaF_mu = LambdaF * mu;
     }
 
 };
@@ -101,25 +184,27 @@ struct Sys {
     
     //-- c'tor
     std::string name;
+    uint32_t rng_id; // first key of the random streams of this Sys
     int iter;
     Sys(std::string name, std::string fname, std::string pname);
-    Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &Pavg);
+    Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T);
     virtual ~Sys();
     void init();
     virtual void alloc_and_init() = 0;
 
     //-- sparse matrix
-    SparseMatrixD M; // known ratings
+    RatingMatrix M; // known ratings
     double mean_rating;
     int num() const { return M.cols(); }
-    int nnz() const { return M.nonZeros(); }
-    int nnz(int i) const { return M.col(i).nonZeros(); }
+    long nnz() const { return M.nonZeros(); }
+    int nnz(int i) const { return M.nnz(i); }
 
     // assignment and connectivity
     typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> PermMatrix;
     void permuteCols(const PermMatrix &, Sys &other); 
     void unpermuteCols(Sys &other); 
     PermMatrix col_permutation;
+    uint32_t orig_col(int pos) const { return col_permutation.indices()(pos); }
     void assign(Sys &);
     bool assigned;
 
@@ -155,38 +240,72 @@ struct Sys {
     unsigned recv_count(int from) { return conn_count(from, Sys::procid); }
 
     //-- factors of the MF
-    double* items_ptr;
-    MapNXd items() const { return MapNXd(items_ptr, num_latent, num()); }
-    VectorNd sample(long idx, const MapNXd in);
+    ItemScalar* items_ptr;
+    template<int K = Eigen::Dynamic>
+    ItemsNXi<K> items() const { return ItemsNXi<K>(items_ptr, num_latent, num(), Eigen::OuterStride<>(num_latent_padded())); }
+
+    // read-only copies of the items on each NUMA node (-R, with BPMF_NUMA), refreshed
+    // by replicate() before the other Sys samples and read through items_near()
+    static bool replicate_items;
+    std::vector<ItemScalar *> replicas; // by node
+    void replicate();
+    void free_replicas();
+    ItemScalar *near_items_ptr() const;
+    template<int K = Eigen::Dynamic>
+    ItemsNXi<K> items_near() const { return ItemsNXi<K>(near_items_ptr(), num_latent, num(), Eigen::OuterStride<>(num_latent_padded())); }
+    template<int K> VectorNd<K> sample(long idx, const ItemsNXi<K> in);
+    template<int K> VectorNd<K> sample_woodbury(long idx, const ItemsNXi<K> in, const ConstMapNNd<K> &LambdaL, const ConstMapNd<K> &mu);
+    template<int K> void sample_batch(const int *idx, int n, const ItemsNXi<K> in);
+
+    // sampling path in sample(idx, in) by number of ratings of the item:
+    //   [0, breakpoint0): Woodbury identity on a count x count system (breakpoint0 <= num_latent)
+    //   [breakpoint0, breakpoint1): rank-one updates of the prior Cholesky factor
+    //   [breakpoint1, breakpoint2): full Cholesky decomposition
+    //   [breakpoint2, ...): full Cholesky with thread-parallel accumulation
+    static int breakpoint0, breakpoint1, breakpoint2;
+
+    // items with less ratings are sampled BPMF_SIMD_WIDTH at a time by sample_batch,
+    // for fixed K without propagated posterior (0 = off)
+    static int breakpoint_batch;
+    std::vector<int> batch_order;
 
     //-- for propagated posterior
     Eigen::MatrixXd propMu, propLambda;
+    Eigen::MatrixXd propLambdaL;  // packed lower Cholesky factor of each propLambda
+    Eigen::MatrixXd propLambdaMu; // propLambda * propMu of each item
     void add_prop_posterior(std::string);
     bool has_prop_posterior() const;
 
-    //-- for aggregated posterior
-    Eigen::MatrixXd aggrMu, aggrLambda;
-    void finalize_mu_lambda();
+    //-- for aggregated posterior, with the running mean of the samples of each item
+    //   and the packed upper triangle (column by column) of their sum of squared deviations
+    Eigen::Matrix<AggrScalar, Eigen::Dynamic, Eigen::Dynamic> aggrMu, aggrLambda;
+    void finalize_mu_lambda(std::string mu_fname, std::string lambda_fname);
     
     // virtual functions will be overriden based on COMM: NO_COMM, MPI, or GASPI
     virtual void send_items(int, int) = 0;
     void bcast();
     virtual void sample(Sys &in);
+    template<int K> void sample(Sys &in);
     static unsigned grain_size;
 
+    // sample the light items largest cost first (longest processing time)
+    static bool sort_by_cost;
+    std::vector<int> sample_order;
+    void order_by_cost();
+
     //-- covariance
     double *sum_ptr;
-    MapNXd sum_map() const { return MapNXd(sum_ptr, num_latent, Sys::nprocs); }
-    MapNXd::ColXpr sum(int i)  const { return sum_map().col(i); }
-    MapNXd::ColXpr local_sum() const { return sum(Sys::procid); }
-    VectorNd aggr_sum() const { return sum_map().rowwise().sum(); }
+    MapNXd<Eigen::Dynamic> sum_map() const { return MapNXd<Eigen::Dynamic>(sum_ptr, num_latent, Sys::nprocs); }
+    MapNXd<Eigen::Dynamic>::ColXpr sum(int i)  const { return sum_map().col(i); }
+    MapNXd<Eigen::Dynamic>::ColXpr local_sum() const { return sum(Sys::procid); }
+    Eigen::VectorXd aggr_sum() const { return sum_map().rowwise().sum(); }
 
     double *cov_ptr;
-    MapNXd cov_map() const { return MapNXd(cov_ptr, num_latent, Sys::nprocs * num_latent); }
-    MapNXd cov(int i) const { return MapNXd(cov_ptr + i*num_latent*num_latent, num_latent, num_latent); }
-    MapNXd local_cov() { return cov(Sys::procid); }
-    MatrixNNd aggr_cov() const { 
-        MatrixNNd ret(MatrixNNd::Zero());
+    MapNXd<Eigen::Dynamic> cov_map() const { return MapNXd<Eigen::Dynamic>(cov_ptr, num_latent, Sys::nprocs * num_latent); }
+    MapNXd<Eigen::Dynamic> cov(int i) const { return MapNXd<Eigen::Dynamic>(cov_ptr + i*num_latent*num_latent, num_latent, num_latent); }
+    MapNXd<Eigen::Dynamic> local_cov() { return cov(Sys::procid); }
+    Eigen::MatrixXd aggr_cov() const { 
+        Eigen::MatrixXd ret(Eigen::MatrixXd::Zero(num_latent, num_latent));
         for(int i=0; i<Sys::nprocs; ++i) ret += cov(i);
         return ret;
     }
@@ -200,15 +319,46 @@ struct Sys {
 
     //-- hyper params
     HyperParams hp;
-    virtual void sample_hp() { hp.sample(num(), aggr_sum(), aggr_cov()); }
+    virtual void sample_hp();
+    template<int K> void sample_hp() {
+        rng_seek(rng_id, iter, UINT32_MAX); // the same on all processes
+        hp.sample<K>(num(), aggr_sum(), aggr_cov());
+    }
 
     // output predictions
-    SparseMatrixD T, Torig; // test matrix (input)
-    SparseMatrixD Pavg, Pm2; // predictions for items in T (output)`
+    std::shared_ptr<TestMatrix> T; // test matrix (input), shared with the other Sys
+    bool T_by_row;                 // the items of this Sys are the rows of T
+    int test_nnz(int i) const { return T->nnz(i, T_by_row); }
     double rmse, rmse_avg;
+    double rmse_ci, rmse_avg_ci; // half width of the 95% confidence intervals, 0 if exact
+    int rmse_iter = -1;          // iteration of rmse
+    bool predict_in_sample = false; // sample(in) scores the test ratings of each item it draws (-e)
     void predict(Sys& other, bool all = false);
+    void predict_item(int k, const ItemScalar *other, double &se, double &se_avg, long &nump);
+    void update_predictions(int k, long from, long to, const double *dot, double &se, double &se_avg, long &nump);
     void print(double, double, double, double); 
 
+    // training RMSE and log-likelihood (-L)
+    static bool train_monitor;
+    double train_rmse, train_loglik;
+    int train_iter = -1;
+    void train_eval(Sys& other);
+
+    // exact evaluation every eval_every iterations (-E), in between the samples
+    // are kept and replayed into Pavg and Pm2 by the next predict, and only
+    // a fixed random fraction eval_fraction of the test ratings is scored (-S)
+    static int eval_every;
+    static double eval_fraction;
+    struct Snapshot { int n; std::vector<ItemScalar> items, other; }; // a sample of both Sys
+    std::vector<Snapshot> history; // the first nhistory are not in Pavg and Pm2 yet, oldest first
+    int nhistory = 0;
+    struct TestRating { int item, other; long pos; };
+    std::vector<TestRating> subsample;   // local test ratings scored every iteration
+    std::vector<char> in_subsample;      // by nonzero of T
+    void defer_predict(Sys& other);
+    void flush_predict(Sys& other);
+    void predict_subsample(Sys& other);
+
     // performance counting
     std::vector<double> sample_time;
     void register_time(int i, double t);
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "convergence.h"
+
+void Convergence::add(const std::string &name, int iter, double value)
+{
+    traces[name].push_back(std::make_pair(iter, value));
+}
+
+std::vector<double> Convergence::values(const std::vector<std::pair<int, double>> &t, int from, int to)
+{
+    std::vector<double> x;
+    for (auto &v : t)
+        if (v.first >= from && v.first <= to) x.push_back(v.second);
+    return x;
+}
+
+double Convergence::max_rhat(int iter, std::string &name) const
+{
+    double worst = 0.0;
+    for (auto &t : traces)
+    {
+        auto x = values(t.second, (iter + 1) / 2, iter);
+        if ((int)x.size() < min_values) continue;
+        const double r = split_rhat(x);
+        if (r > worst) { worst = r; name = t.first; }
+    }
+    return worst;
+}
+
+double Convergence::min_ess(int from, std::string &name) const
+{
+    double worst = 0.0;
+    for (auto &t : traces)
+    {
+        auto x = values(t.second, from, INT_MAX);
+        if ((int)x.size() < min_values) continue;
+        const double e = effective_sample_size(x);
+        if (worst == 0.0 || e < worst) { worst = e; name = t.first; }
+    }
+    return worst;
+}
+
+static double mean(const double *x, int n)
+{
+    double s = 0.0;
+    for (int i = 0; i < n; ++i) s += x[i];
+    return s / n;
+}
+
+static double variance(const double *x, int n, double m)
+{
+    double s = 0.0;
+    for (int i = 0; i < n; ++i) s += (x[i] - m) * (x[i] - m);
+    return s / (n - 1);
+}
+
+// two chains: the first and the last half of x (without the middle value if odd)
+double split_rhat(const std::vector<double> &x)
+{
+    const int n = x.size() / 2;
+    const double *c0 = x.data(), *c1 = x.data() + x.size() - n;
+    const double m0 = mean(c0, n), m1 = mean(c1, n), m = (m0 + m1) / 2;
+    const double W = (variance(c0, n, m0) + variance(c1, n, m1)) / 2; // within
+    const double B = n * ((m0 - m) * (m0 - m) + (m1 - m) * (m1 - m)); // between, m - 1 = 1
+    if (W <= 0.0) return (B <= 0.0) ? 1.0 : INFINITY;
+    const double var = (n - 1.0) / n * W + B / n;
+    return std::sqrt(var / W);
+}
+
+// n / (1 + 2 sum of the autocorrelations), summed by pairs while positive,
+// each pair at most the previous one (Geyer's initial monotone sequence)
+double effective_sample_size(const std::vector<double> &x)
+{
+    const int n = x.size();
+    const double m = mean(x.data(), n);
+    auto autocov = [&](int k) {
+        double s = 0.0;
+        for (int i = 0; i + k < n; ++i) s += (x[i] - m) * (x[i + k] - m);
+        return s / n;
+    };
+
+    const double c0 = autocov(0);
+    if (c0 <= 0.0) return n;
+
+    double tau = -1.0, prev = INFINITY;
+    for (int k = 0; k + 1 < n; k += 2)
+    {
+        const double pair = std::min(prev, (autocov(k) + autocov(k + 1)) / c0);
+        if (pair <= 0.0) break;
+        tau += 2.0 * pair;
+        prev = pair;
+    }
+    return (tau <= 0.0) ? n : std::min((double)n, n / tau);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+//
+// Convergence diagnostics of scalar traces of the sampler, for the adaptive
+// burn-in (-B) and the early stop (-X)
+//
+// The burn-in can end when the second half of every trace so far is
+// stationary: its split-R-hat (Gelman et al., Bayesian Data Analysis, 3rd ed.,
+// 11.4) is below a tolerance. Sampling can stop when every trace since the
+// burn-in holds enough effective samples (initial monotone sequence of
+// Geyer, 1992). Traces with less than min_values values are not checked.
+//
+class Convergence
+{
+  public:
+    static const int min_values = 8;
+
+    // records value of trace name at iteration iter
+    void add(const std::string &name, int iter, double value);
+
+    // largest split-R-hat of the traces over the iterations [(iter + 1) / 2, iter],
+    // 0 if no trace is long enough; the trace with it in name
+    double max_rhat(int iter, std::string &name) const;
+
+    // smallest effective sample size of the traces from iteration from on,
+    // 0 if no trace is long enough; the trace with it in name
+    double min_ess(int from, std::string &name) const;
+
+  private:
+    std::map<std::string, std::vector<std::pair<int, double>>> traces;
+
+    // the values of trace t from iteration from to iteration to
+    static std::vector<double> values(const std::vector<std::pair<int, double>> &t, int from, int to);
+};
+
+double split_rhat(const std::vector<double> &x);
+double effective_sample_size(const std::vector<double> &x);
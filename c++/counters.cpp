@@ -65,6 +65,46 @@ void TotalsCounter::print() {
 
 #endif // BPMF_PROFILING
 
+#ifdef BPMF_MALLOC_CHECK
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "bpmf.h"
+#include "error.h"
+
+static std::atomic<long> new_count(0);
+
+void *operator new(size_t size)
+{
+    new_count++;
+    void *p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+MallocGuard::MallocGuard(const char *name, bool enforce)
+    : name(name), enforce(enforce), start(new_count)
+{
+    if (enforce) Eigen::internal::set_is_malloc_allowed(false);
+}
+
+MallocGuard::~MallocGuard() noexcept(false)
+{
+    if (!enforce) return;
+    Eigen::internal::set_is_malloc_allowed(true);
+    const long n = new_count - start;
+    if (n) THROWERROR(std::string(name) + ": " + std::to_string(n) + " calls of operator new");
+}
+
+#endif // BPMF_MALLOC_CHECK
+
 double tick() {
     return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now().time_since_epoch()).count(); 
 }
@@ -51,3 +51,24 @@ extern TotalsCounter perf_data;
 #define BPMF_COUNTER(name) 
 
 #endif //BPMF_PROFILING
+
+#ifdef BPMF_MALLOC_CHECK
+
+// fails when its scope allocates: Eigen asserts on its own allocations,
+// calls of the global operator new are counted
+#define BPMF_NO_MALLOC(name, enforce) MallocGuard g(name, enforce)
+
+struct MallocGuard {
+    const char *name;
+    bool enforce;
+    long start;
+
+    MallocGuard(const char *name, bool enforce);
+    ~MallocGuard() noexcept(false);
+};
+
+#else
+
+#define BPMF_NO_MALLOC(name, enforce)
+
+#endif //BPMF_MALLOC_CHECK
@@ -47,7 +47,7 @@ struct GASPI_Sys : public Sys
 {
     //-- c'tor
     GASPI_Sys(std::string name, std::string fname, std::string probename) : Sys(name, fname, probename) {}
-    GASPI_Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &P) : Sys(name, M, P) {}
+    GASPI_Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T) : Sys(name, M, T) {}
     ~GASPI_Sys();
     virtual void alloc_and_init();
 
@@ -89,7 +89,7 @@ void GASPI_Sys::alloc_and_init()
     sync_time.resize(Sys::nprocs);
 
     static gaspi_segment_id_t seg_id_cnt = 0;
-    items_ptr = gaspi_malloc(seg_id_cnt, sizeof(double) * num_latent * num());
+    items_ptr = (ItemScalar *)gaspi_malloc(seg_id_cnt, sizeof(ItemScalar) * num_latent_padded() * num());
     items_seg = seg_id_cnt++;
     sum_ptr = gaspi_malloc(seg_id_cnt, sizeof(double) * num_latent * Sys::nprocs);
     sum_seg = seg_id_cnt++;
@@ -135,8 +135,8 @@ void GASPI_Sys::actual_send(int from, int to)
         for (int k = 0; k < Sys::nprocs; k++)
         {
             if (!conn(i, k)) continue;
-            auto offset = i * num_latent * sizeof(double);
-            auto size = num_latent * sizeof(double);
+            auto offset = i * num_latent_padded() * sizeof(ItemScalar);
+            auto size = num_latent * sizeof(ItemScalar);
             SUCCESS_OR_DIE(gaspi_write(items_seg, offset, k, items_seg, offset, size, 0, GASPI_BLOCK));
             assert((free - 1) == gaspi_free(0));
             if (--free <= 0) free = gaspi_wait_for_queue(0);
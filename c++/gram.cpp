@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <cstring>
+
+#include "gram.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BPMF_GRAM_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*gram_fn)(int, const double *, int, const int *, const double *, long, long,
+                        double, double, double *, double *);
+
+//
+// portable version, also used for the tails of the SIMD versions
+//
+template<typename T>
+static void gram_scalar(int K, const T *in, int ld, const int *idx, const double *val, long from, long to,
+                        double mean, double alpha, T *packed, T *rr)
+{
+    for (long j = from; j < to; ++j)
+    {
+        const T *v = in + (long)ld * idx[j];
+        const T w = (val[j] - mean) * alpha;
+
+        for (int i = 0; i < K; ++i) rr[i] += v[i] * w;
+
+        T *p = packed;
+        for (int c = 0; c < K; ++c)
+        {
+            const T vc = v[c];
+            const int n = gram_padded(c + 1);
+            for (int i = 0; i < n; ++i) p[i] += v[i] * vc;
+            p += n;
+        }
+    }
+}
+
+#ifdef BPMF_GRAM_X86
+
+//
+// AVX2 version: four ratings are accumulated per sweep over the packed
+// triangle, so each packed element is loaded and stored once per four ratings
+//
+__attribute__((target("avx2,fma")))
+static void gram_avx2(int K, const double *in, int ld, const int *idx, const double *val, long from, long to,
+                      double mean, double alpha, double *packed, double *rr)
+{
+    long j = from;
+    for (; j + 4 <= to; j += 4)
+    {
+        const double *v0 = in + (long)ld * idx[j];
+        const double *v1 = in + (long)ld * idx[j + 1];
+        const double *v2 = in + (long)ld * idx[j + 2];
+        const double *v3 = in + (long)ld * idx[j + 3];
+        const double w0 = (val[j] - mean) * alpha;
+        const double w1 = (val[j + 1] - mean) * alpha;
+        const double w2 = (val[j + 2] - mean) * alpha;
+        const double w3 = (val[j + 3] - mean) * alpha;
+
+        int i = 0;
+        for (; i + 4 <= K; i += 4)
+        {
+            __m256d r = _mm256_loadu_pd(rr + i);
+            r = _mm256_fmadd_pd(_mm256_loadu_pd(v0 + i), _mm256_set1_pd(w0), r);
+            r = _mm256_fmadd_pd(_mm256_loadu_pd(v1 + i), _mm256_set1_pd(w1), r);
+            r = _mm256_fmadd_pd(_mm256_loadu_pd(v2 + i), _mm256_set1_pd(w2), r);
+            r = _mm256_fmadd_pd(_mm256_loadu_pd(v3 + i), _mm256_set1_pd(w3), r);
+            _mm256_storeu_pd(rr + i, r);
+        }
+        for (; i < K; ++i) rr[i] += v0[i] * w0 + v1[i] * w1 + v2[i] * w2 + v3[i] * w3;
+
+        double *p = packed;
+        for (int c = 0; c < K; ++c)
+        {
+            const __m256d b0 = _mm256_set1_pd(v0[c]);
+            const __m256d b1 = _mm256_set1_pd(v1[c]);
+            const __m256d b2 = _mm256_set1_pd(v2[c]);
+            const __m256d b3 = _mm256_set1_pd(v3[c]);
+            const int n = gram_padded(c + 1);
+            for (int i = 0; i < n; i += 4)
+            {
+                __m256d a = _mm256_loadu_pd(p + i);
+                a = _mm256_fmadd_pd(_mm256_loadu_pd(v0 + i), b0, a);
+                a = _mm256_fmadd_pd(_mm256_loadu_pd(v1 + i), b1, a);
+                a = _mm256_fmadd_pd(_mm256_loadu_pd(v2 + i), b2, a);
+                a = _mm256_fmadd_pd(_mm256_loadu_pd(v3 + i), b3, a);
+                _mm256_storeu_pd(p + i, a);
+            }
+            p += n;
+        }
+    }
+
+    gram_scalar(K, in, ld, idx, val, j, to, mean, alpha, packed, rr);
+}
+
+//
+// AVX-512 version: same blocking as AVX2, tails are handled with masks
+//
+__attribute__((target("avx512f")))
+static void gram_avx512(int K, const double *in, int ld, const int *idx, const double *val, long from, long to,
+                        double mean, double alpha, double *packed, double *rr)
+{
+    long j = from;
+    for (; j + 4 <= to; j += 4)
+    {
+        const double *v0 = in + (long)ld * idx[j];
+        const double *v1 = in + (long)ld * idx[j + 1];
+        const double *v2 = in + (long)ld * idx[j + 2];
+        const double *v3 = in + (long)ld * idx[j + 3];
+        const __m512d w0 = _mm512_set1_pd((val[j] - mean) * alpha);
+        const __m512d w1 = _mm512_set1_pd((val[j + 1] - mean) * alpha);
+        const __m512d w2 = _mm512_set1_pd((val[j + 2] - mean) * alpha);
+        const __m512d w3 = _mm512_set1_pd((val[j + 3] - mean) * alpha);
+
+        for (int i = 0; i < K; i += 8)
+        {
+            const __mmask8 m = (K - i >= 8) ? 0xFF : (__mmask8)((1u << (K - i)) - 1);
+            __m512d r = _mm512_maskz_loadu_pd(m, rr + i);
+            r = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v0 + i), w0, r);
+            r = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v1 + i), w1, r);
+            r = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v2 + i), w2, r);
+            r = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v3 + i), w3, r);
+            _mm512_mask_storeu_pd(rr + i, m, r);
+        }
+
+        double *p = packed;
+        for (int c = 0; c < K; ++c)
+        {
+            const __m512d b0 = _mm512_set1_pd(v0[c]);
+            const __m512d b1 = _mm512_set1_pd(v1[c]);
+            const __m512d b2 = _mm512_set1_pd(v2[c]);
+            const __m512d b3 = _mm512_set1_pd(v3[c]);
+            const int n = gram_padded(c + 1);
+            int i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                __m512d a = _mm512_loadu_pd(p + i);
+                a = _mm512_fmadd_pd(_mm512_loadu_pd(v0 + i), b0, a);
+                a = _mm512_fmadd_pd(_mm512_loadu_pd(v1 + i), b1, a);
+                a = _mm512_fmadd_pd(_mm512_loadu_pd(v2 + i), b2, a);
+                a = _mm512_fmadd_pd(_mm512_loadu_pd(v3 + i), b3, a);
+                _mm512_storeu_pd(p + i, a);
+            }
+            if (i < n)
+            {
+                const __mmask8 m = (__mmask8)((1u << (n - i)) - 1);
+                __m512d a = _mm512_maskz_loadu_pd(m, p + i);
+                a = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v0 + i), b0, a);
+                a = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v1 + i), b1, a);
+                a = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v2 + i), b2, a);
+                a = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, v3 + i), b3, a);
+                _mm512_mask_storeu_pd(p + i, m, a);
+            }
+            p += n;
+        }
+    }
+
+    gram_scalar(K, in, ld, idx, val, j, to, mean, alpha, packed, rr);
+}
+
+//
+// AVX2 version in single precision: same blocking as the double version,
+// eight floats per vector, the packed columns are padded to four
+//
+__attribute__((target("avx2,fma")))
+static void gram_avx2_float(int K, const float *in, int ld, const int *idx, const double *val, long from, long to,
+                            double mean, double alpha, float *packed, float *rr)
+{
+    long j = from;
+    for (; j + 4 <= to; j += 4)
+    {
+        const float *v0 = in + (long)ld * idx[j];
+        const float *v1 = in + (long)ld * idx[j + 1];
+        const float *v2 = in + (long)ld * idx[j + 2];
+        const float *v3 = in + (long)ld * idx[j + 3];
+        const float w0 = (val[j] - mean) * alpha;
+        const float w1 = (val[j + 1] - mean) * alpha;
+        const float w2 = (val[j + 2] - mean) * alpha;
+        const float w3 = (val[j + 3] - mean) * alpha;
+
+        int i = 0;
+        for (; i + 8 <= K; i += 8)
+        {
+            __m256 r = _mm256_loadu_ps(rr + i);
+            r = _mm256_fmadd_ps(_mm256_loadu_ps(v0 + i), _mm256_set1_ps(w0), r);
+            r = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i), _mm256_set1_ps(w1), r);
+            r = _mm256_fmadd_ps(_mm256_loadu_ps(v2 + i), _mm256_set1_ps(w2), r);
+            r = _mm256_fmadd_ps(_mm256_loadu_ps(v3 + i), _mm256_set1_ps(w3), r);
+            _mm256_storeu_ps(rr + i, r);
+        }
+        for (; i < K; ++i) rr[i] += v0[i] * w0 + v1[i] * w1 + v2[i] * w2 + v3[i] * w3;
+
+        float *p = packed;
+        for (int c = 0; c < K; ++c)
+        {
+            const int n = gram_padded(c + 1);
+            int i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256 a = _mm256_loadu_ps(p + i);
+                a = _mm256_fmadd_ps(_mm256_loadu_ps(v0 + i), _mm256_set1_ps(v0[c]), a);
+                a = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i), _mm256_set1_ps(v1[c]), a);
+                a = _mm256_fmadd_ps(_mm256_loadu_ps(v2 + i), _mm256_set1_ps(v2[c]), a);
+                a = _mm256_fmadd_ps(_mm256_loadu_ps(v3 + i), _mm256_set1_ps(v3[c]), a);
+                _mm256_storeu_ps(p + i, a);
+            }
+            if (i < n)
+            {
+                __m128 a = _mm_loadu_ps(p + i);
+                a = _mm_fmadd_ps(_mm_loadu_ps(v0 + i), _mm_set1_ps(v0[c]), a);
+                a = _mm_fmadd_ps(_mm_loadu_ps(v1 + i), _mm_set1_ps(v1[c]), a);
+                a = _mm_fmadd_ps(_mm_loadu_ps(v2 + i), _mm_set1_ps(v2[c]), a);
+                a = _mm_fmadd_ps(_mm_loadu_ps(v3 + i), _mm_set1_ps(v3[c]), a);
+                _mm_storeu_ps(p + i, a);
+            }
+            p += n;
+        }
+    }
+
+    gram_scalar(K, in, ld, idx, val, j, to, mean, alpha, packed, rr);
+}
+
+static bool cpu_has(const char *name)
+{
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx512")) return __builtin_cpu_supports("avx512f");
+    if (!strcmp(name, "avx2")) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return !strcmp(name, "scalar");
+}
+
+#else
+
+static bool cpu_has(const char *name) { return !strcmp(name, "scalar"); }
+
+#endif // BPMF_GRAM_X86
+
+static struct { const char *name; gram_fn fn; } kernels[] = {
+#ifdef BPMF_GRAM_X86
+    { "avx512", gram_avx512 },
+    { "avx2", gram_avx2 },
+#endif
+    { "scalar", gram_scalar<double> },
+};
+
+// best supported kernel comes first
+static int selected = -1;
+
+static int select_best()
+{
+    int i = 0;
+    while (!cpu_has(kernels[i].name)) i++;
+    return i;
+}
+
+void gram_accumulate(int K, const double *in, int ld, const int *idx, const double *val, long from, long to,
+                     double mean, double alpha, double *packed, double *rr)
+{
+    static const int best = select_best();
+    kernels[selected < 0 ? best : selected].fn(K, in, ld, idx, val, from, to, mean, alpha, packed, rr);
+}
+
+void gram_accumulate(int K, const float *in, int ld, const int *idx, const double *val, long from, long to,
+                     double mean, double alpha, float *packed, float *rr)
+{
+#ifdef BPMF_GRAM_X86
+    static const bool avx2 = cpu_has("avx2");
+    if (avx2 && (selected < 0 || strcmp(kernels[selected].name, "scalar")))
+    {
+        gram_avx2_float(K, in, ld, idx, val, from, to, mean, alpha, packed, rr);
+        return;
+    }
+#endif
+    gram_scalar(K, in, ld, idx, val, from, to, mean, alpha, packed, rr);
+}
+
+const char *gram_kernel_name()
+{
+    return kernels[selected < 0 ? select_best() : selected].name;
+}
+
+bool gram_select_kernel(const char *name)
+{
+    if (!cpu_has(name)) return false;
+    for (selected = 0; strcmp(kernels[selected].name, name); selected++);
+    return true;
+}
+
+void gram_unpack(int K, const double *packed, double *full)
+{
+    for (int j = 0; j < K; ++j)
+    {
+        const double *p = packed + gram_packed_size(j);
+        for (int i = 0; i <= j; ++i)
+        {
+            full[j * K + i] = full[i * K + j] = p[i];
+        }
+    }
+}
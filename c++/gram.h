@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+//
+// Gram matrix accumulation for the sampling of one user/movie
+//
+// For the ratings [from, to) of a sparse column (idx = row indices, val = values)
+// accumulates in one pass:
+//    packed += sum v * v^T                      (upper triangle, packed by column)
+//    rr     += sum v * ((val - mean) * alpha)
+// where v = in + ld * idx[j] is the latent vector of the j-th rating,
+// zero padded up to ld >= gram_padded(K) doubles.
+//
+// The packed upper triangle stores column j from gram_packed_size(j) on, padded
+// to gram_padded(j + 1) doubles, so the kernels only use full SIMD vectors.
+// Element (i,j), i <= j, is at gram_packed_size(j) + i; the padding lanes are
+// ignored.
+//
+void gram_accumulate(int K, const double *in, int ld, const int *idx, const double *val, long from, long to,
+                     double mean, double alpha, double *packed, double *rr);
+
+// same in single precision, uses the AVX2 kernel unless "scalar" is selected
+void gram_accumulate(int K, const float *in, int ld, const int *idx, const double *val, long from, long to,
+                     double mean, double alpha, float *packed, float *rr);
+
+// n rounded up to the SIMD width of the kernels (4 doubles)
+constexpr int gram_padded(int n) { return (n + 3) / 4 * 4; }
+
+// number of doubles in a padded packed K x K triangle
+constexpr int gram_packed_size(int K) { return 4 * (K / 4 + 1) * (2 * (K / 4) + K % 4); }
+
+// copies the packed upper triangle in both triangles of a column-major K x K matrix
+void gram_unpack(int K, const double *packed, double *full);
+
+// name of the kernel used by gram_accumulate: "avx512", "avx2" or "scalar"
+const char *gram_kernel_name();
+
+// forces a kernel by name, returns false if not supported on this CPU
+bool gram_select_kernel(const char *name);
@@ -161,7 +161,7 @@ void read_matrix(const std::string& filename, Eigen::MatrixXd& X)
    delete stream;
 }
 
-void read_matrix(const std::string& filename, Eigen::SparseMatrix<double>& X)
+void read_matrix(const std::string& filename, SparseMatrixD& X)
 {
    MatrixType matrixType = ExtensionToMatrixType(filename);
    std::istream *stream = open_inputfile(filename);
@@ -251,7 +251,7 @@ void read_dense_float64_csv(std::istream& in, Eigen::MatrixXd& X)
    }
 }
 
-void read_sparse_float64_bin(std::istream& in, Eigen::SparseMatrix<double>& X)
+void read_sparse_float64_bin(std::istream& in, SparseMatrixD& X)
 {
    std::uint64_t nrow;
    std::uint64_t ncol;
@@ -272,20 +272,20 @@ void read_sparse_float64_bin(std::istream& in, Eigen::SparseMatrix<double>& X)
    std::vector<double> values(nnz);
    in.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(double));
 
-   std::vector<Eigen::Triplet<double> > triplets;
+   std::vector<Eigen::Triplet<double, SparseIndex> > triplets;
    for(uint64_t i = 0; i < nnz; i++)
-      triplets.push_back(Eigen::Triplet<double>(rows[i], cols[i], values[i]));
+      triplets.push_back(Eigen::Triplet<double, SparseIndex>(rows[i], cols[i], values[i]));
 
    X.resize(nrow, ncol);
    X.setFromTriplets(triplets.begin(), triplets.end());
 
-   if(X.nonZeros() != (int)nnz)
+   if((std::uint64_t)X.nonZeros() != nnz)
    {
       THROWERROR("Invalid number of values");
    }
 }
 
-void read_sparse_binary_bin(std::istream& in, Eigen::SparseMatrix<double>& X)
+void read_sparse_binary_bin(std::istream& in, SparseMatrixD& X)
 {
    std::uint64_t nrow;
    std::uint64_t ncol;
@@ -303,9 +303,9 @@ void read_sparse_binary_bin(std::istream& in, Eigen::SparseMatrix<double>& X)
    in.read(reinterpret_cast<char*>(cols.data()), cols.size() * sizeof(std::uint32_t));
    std::for_each(cols.begin(), cols.end(), [](std::uint32_t& col){ col--; });
 
-   std::vector<Eigen::Triplet<double> > triplets;
+   std::vector<Eigen::Triplet<double, SparseIndex> > triplets;
    for(uint64_t i = 0; i < nnz; i++)
-      triplets.push_back(Eigen::Triplet<double>(rows[i], cols[i], 1));
+      triplets.push_back(Eigen::Triplet<double, SparseIndex>(rows[i], cols[i], 1));
 
    X.resize(nrow, ncol);
    X.setFromTriplets(triplets.begin(), triplets.end());
@@ -409,7 +409,7 @@ void read_matrix_market(std::istream& in, Eigen::MatrixXd& X)
 
 // MatrixMarket format specification
 // https://github.com/ExaScience/smurff/files/1398286/MMformat.pdf
-void read_matrix_market(std::istream& in, Eigen::SparseMatrix<double>& X)
+void read_matrix_market(std::istream& in, SparseMatrixD& X)
 {
    // Check that stream has MatrixMarket format data
    std::array<char, 15> matrixMarketArr;
@@ -486,7 +486,7 @@ void read_matrix_market(std::istream& in, Eigen::SparseMatrix<double>& X)
 
    X.resize(nrows, ncols);
 
-   std::vector<Eigen::Triplet<double> > triplets;
+   std::vector<Eigen::Triplet<double, SparseIndex> > triplets;
    triplets.reserve(nnz);
 
    for (std::uint64_t i = 0; i < nnz; i++)
@@ -513,7 +513,7 @@ void read_matrix_market(std::istream& in, Eigen::SparseMatrix<double>& X)
          THROWERROR("Could not parse an entry line for coordinate matrix format");
       }
 
-      triplets.push_back(Eigen::Triplet<double>(row - 1, col - 1, val));
+      triplets.push_back(Eigen::Triplet<double, SparseIndex>(row - 1, col - 1, val));
    }
 
    X.setFromTriplets(triplets.begin(), triplets.end());
@@ -573,7 +573,7 @@ void write_matrix(const std::string& filename, const Eigen::MatrixXd& X)
    delete stream;
 }
 
-void write_matrix(const std::string& filename, const Eigen::SparseMatrix<double>& X)
+void write_matrix(const std::string& filename, const SparseMatrixD& X)
 {
    MatrixType matrixType = ExtensionToMatrixType(filename);
    std::ostream *stream = open_outputfile(filename);
@@ -612,6 +612,28 @@ void write_dense_float64_bin(std::ostream& out, const Eigen::MatrixXd& X)
   out.write(reinterpret_cast<const char*>(X.data()), nrow * ncol * sizeof(typename Eigen::MatrixXd::Scalar));
 }
 
+void write_dense_float64_bin(const std::string& filename, std::uint64_t nrow, std::uint64_t ncol,
+                             const std::function<void(std::uint64_t, Eigen::MatrixXd&)>& fill)
+{
+  if (ExtensionToMatrixType(filename).type != MatrixType::ddm)
+     THROWERROR("Invalid matrix type");
+
+  std::ostream *out = open_outputfile(filename);
+  out->write(reinterpret_cast<const char*>(&nrow), sizeof(std::uint64_t));
+  out->write(reinterpret_cast<const char*>(&ncol), sizeof(std::uint64_t));
+
+  const std::uint64_t block = 4096;
+  Eigen::MatrixXd X;
+  for (std::uint64_t from = 0; from < ncol; from += block)
+  {
+     X.resize(nrow, std::min(block, ncol - from));
+     fill(from, X);
+     out->write(reinterpret_cast<const char*>(X.data()), X.size() * sizeof(double));
+  }
+
+  delete out;
+}
+
 const static Eigen::IOFormat csvFormat(6, Eigen::DontAlignCols, ",", "\n");
 
 void write_dense_float64_csv(std::ostream& out, const Eigen::MatrixXd& X)
@@ -621,7 +643,7 @@ void write_dense_float64_csv(std::ostream& out, const Eigen::MatrixXd& X)
    out << X.format(csvFormat) << std::endl;
 }
 
-void write_sparse_float64_bin(std::ostream& out, const Eigen::SparseMatrix<double>& X)
+void write_sparse_float64_bin(std::ostream& out, const SparseMatrixD& X)
 {
    std::uint64_t nrow = X.rows();
    std::uint64_t ncol = X.cols();
@@ -632,7 +654,7 @@ void write_sparse_float64_bin(std::ostream& out, const Eigen::SparseMatrix<doubl
 
    for (int k = 0; k < X.outerSize(); ++k)
    {
-      for (Eigen::SparseMatrix<double>::InnerIterator it(X,k); it; ++it)
+      for (SparseMatrixD::InnerIterator it(X,k); it; ++it)
       {
          rows.push_back(it.row() + 1);
          cols.push_back(it.col() + 1);
@@ -650,7 +672,7 @@ void write_sparse_float64_bin(std::ostream& out, const Eigen::SparseMatrix<doubl
    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(double));
 }
 
-void write_sparse_binary_bin(std::ostream& out, const Eigen::SparseMatrix<double>& X)
+void write_sparse_binary_bin(std::ostream& out, const SparseMatrixD& X)
 {
    std::uint64_t nrow = X.rows();
    std::uint64_t ncol = X.cols();
@@ -660,7 +682,7 @@ void write_sparse_binary_bin(std::ostream& out, const Eigen::SparseMatrix<double
 
    for (int k = 0; k < X.outerSize(); ++k)
    {
-      for (Eigen::SparseMatrix<double>::InnerIterator it(X,k); it; ++it)
+      for (SparseMatrixD::InnerIterator it(X,k); it; ++it)
       {
          if(it.value() > 0)
          {
@@ -692,14 +714,14 @@ void write_matrix_market(std::ostream& out, const Eigen::MatrixXd& X)
    out << X.rows() << " ";
    out << X.cols() << std::endl;
 
-   for (Eigen::SparseMatrix<double>::Index col = 0; col < X.cols(); col++)
-      for (Eigen::SparseMatrix<double>::Index row = 0; row < X.rows(); row++)
+   for (Eigen::Index col = 0; col < X.cols(); col++)
+      for (Eigen::Index row = 0; row < X.rows(); row++)
          out << X(row, col) << std::endl;
 }
 
 // MatrixMarket format specification
 // https://github.com/ExaScience/smurff/files/1398286/MMformat.pdf
-void write_matrix_market(std::ostream& out, const Eigen::SparseMatrix<double>& X)
+void write_matrix_market(std::ostream& out, const SparseMatrixD& X)
 {
    out << "%%MatrixMarket ";
    out << MM_OBJ_MATRIX << " ";
@@ -712,6 +734,6 @@ void write_matrix_market(std::ostream& out, const Eigen::SparseMatrix<double>& X
    out << X.nonZeros() << std::endl;
 
    for (Eigen::Index i = 0; i < X.outerSize(); ++i)
-      for (Eigen::SparseMatrix<double>::InnerIterator it(X, i); it; ++it)
+      for (SparseMatrixD::InnerIterator it(X, i); it; ++it)
          out << it.row() + 1 << " " << it.col() + 1 << " " << it.value() << std::endl;
 }
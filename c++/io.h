@@ -2,8 +2,10 @@
 
 #include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <numeric>
@@ -13,6 +15,19 @@
 #include <Eigen/Sparse>
 #include <Eigen/Dense>
 
+//
+// Index of the nonzeros of the sparse matrices: int, or with -DBPMF_INDEX64
+// a 64-bit integer for more than 2^31 - 1 nonzeros. Row and column indices
+// stay 32-bit in the files and in the compact matrices of ratings.h.
+//
+#ifdef BPMF_INDEX64
+typedef std::int64_t SparseIndex;
+#else
+typedef int SparseIndex;
+#endif
+
+typedef Eigen::SparseMatrix<double, Eigen::ColMajor, SparseIndex> SparseMatrixD;
+
 //
 // GitHub issue #34:
 //    https://github.com/ExaScience/smurff/issues/34
@@ -45,30 +60,35 @@ void read_matrix(const std::string& filename, Eigen::VectorXd& V);
 
 void read_matrix(const std::string& filename, Eigen::MatrixXd& X);
 
-void read_matrix(const std::string& filename, Eigen::SparseMatrix<double>& X);
+void read_matrix(const std::string& filename, SparseMatrixD& X);
 
 void read_dense_float64_bin(std::istream& in, Eigen::MatrixXd& X);
 void read_dense_float64_csv(std::istream& in, Eigen::MatrixXd& X);
 
-void read_sparse_float64_bin(std::istream& in, Eigen::SparseMatrix<double>& X);
+void read_sparse_float64_bin(std::istream& in, SparseMatrixD& X);
 
-void read_sparse_binary_bin(std::istream& in, Eigen::SparseMatrix<double>& X);
+void read_sparse_binary_bin(std::istream& in, SparseMatrixD& X);
 
 void read_matrix_market(std::istream& in, Eigen::MatrixXd& X);
-void read_matrix_market(std::istream& in, Eigen::SparseMatrix<double>& X);
+void read_matrix_market(std::istream& in, SparseMatrixD& X);
 
 // ===
 
 void write_matrix(const std::string& filename, const Eigen::MatrixXd& X);
 
-void write_matrix(const std::string& filename, const Eigen::SparseMatrix<double>& X);
+void write_matrix(const std::string& filename, const SparseMatrixD& X);
 
 void write_dense_float64_bin(std::ostream& out, const Eigen::MatrixXd& X);
+
+// .ddm file of nrow x ncol written block by block, for matrices not stored as doubles:
+// fill(from, X) sets X to the columns [from, from + X.cols())
+void write_dense_float64_bin(const std::string& filename, std::uint64_t nrow, std::uint64_t ncol,
+                             const std::function<void(std::uint64_t, Eigen::MatrixXd&)>& fill);
 void write_dense_float64_csv(std::ostream& out, const Eigen::MatrixXd& X);
 
-void write_sparse_float64_bin(std::ostream& out, const Eigen::SparseMatrix<double>& X);
+void write_sparse_float64_bin(std::ostream& out, const SparseMatrixD& X);
 
-void write_sparse_binary_bin(std::ostream& out, const Eigen::SparseMatrix<double>& X);
+void write_sparse_binary_bin(std::ostream& out, const SparseMatrixD& X);
 
 void write_matrix_market(std::ostream& out, const Eigen::MatrixXd& X);
-void write_matrix_market(std::ostream& out, const Eigen::SparseMatrix<double>& X);
+void write_matrix_market(std::ostream& out, const SparseMatrixD& X);
@@ -9,7 +9,7 @@ struct MPI_Sys : public Sys
 {
     //-- c'tor
     MPI_Sys(std::string name, std::string fname, std::string probename) : Sys(name, fname, probename) {}
-    MPI_Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &P) : Sys(name, M, P) {}
+    MPI_Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T) : Sys(name, M, T) {}
 
     virtual void sample(Sys &in);
     virtual void send_items(int,int) {}
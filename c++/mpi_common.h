@@ -35,7 +35,7 @@ void Sys::Abort(int err)
 }
 void MPI_Sys::alloc_and_init()
 {
-    items_ptr = (double *)malloc(sizeof(double) * num_latent * num());
+    items_ptr = alloc_items(num());
     sum_ptr = (double *)malloc(sizeof(double) * num_latent * MPI_Sys::nprocs);
     cov_ptr = (double *)malloc(sizeof(double) * num_latent * num_latent * MPI_Sys::nprocs);
     norm_ptr = (double *)malloc(sizeof(double) * MPI_Sys::nprocs);
@@ -5,7 +5,6 @@
 
 #include <mpi.h>
 
-#include <list>
 #include <array>
 #include <sstream>
 #include <mutex>
@@ -18,6 +17,7 @@ struct SendRecvBuffer
 {
     const int peer;
     const int total;
+    const int width; // number of T's per element
 
     int num;
     int pos;
@@ -27,7 +27,15 @@ struct SendRecvBuffer
     std::array<std::vector<T>, NC> data;
     std::array<MPI_Request, NC> req;
 
-    typedef std::list<int> lst;
+    // FIFO of chunk indices, without allocation
+    struct lst {
+        std::array<int, NC> v;
+        int head = 0, size = 0;
+        bool empty() const { return size == 0; }
+        int front() const { return v[head]; }
+        void pop_front() { head = (head + 1) % NC; size--; }
+        void push_back(int i) { v[(head + size) % NC] = i; size++; }
+    };
     lst outstanding, empty, avail;
 
     int has(lst s) const { return !s.empty(); }
@@ -41,14 +49,22 @@ struct SendRecvBuffer
     int mark_sent()   { return push(empty, pop(outstanding)); } 
     int mark_free()   { return push(empty, pop(avail)); } 
 
-    SendRecvBuffer(int p, int t) : peer(p), total(t), num(0), pos(0), posted(0)
+    SendRecvBuffer(int p, int t, int w = 1) : peer(p), total(t), width(w), num(0), pos(0), posted(0)
     {
         for(int i=0; i<NC; ++i) {
-            data[i].resize(CS);
+            data[i].resize(CS * width);
             empty.push_back(i);
         }
     }
 
+    // ready for the next iteration, keeps the chunks
+    void reset() {
+        wait_all();
+        outstanding = empty = avail = lst();
+        for(int i=0; i<NC; ++i) empty.push_back(i);
+        num = pos = posted = 0;
+    }
+
     virtual ~SendRecvBuffer() {
         assert(num == total);
     }
@@ -78,10 +94,10 @@ struct SendRecvBuffer
         while (has(outstanding)) this->wait();
     }
 
-    void put(const T &d) {
+    void put(const T *d) {
         assert(has(empty));
 //        log() <<  ":put: num = " << num << " of " << total << std::endl;
-        data[first(empty)].at(pos) = d;
+        std::copy(d, d + width, &data[first(empty)].at(pos * width));
         pos++;
         assert(num < total);
         num++;
@@ -93,23 +109,23 @@ struct SendRecvBuffer
 //        log() <<  ": mpi_isend: num = " << num << " of " << total << std::endl;
         auto p = data.at(first(empty)).data();
         auto s = &req.at(first(empty));
-        MPI_Isend(p, CS * sizeof(T), MPI_BYTE, peer, 0, MPI_COMM_WORLD, s);
+        MPI_Isend(p, CS * width * sizeof(T), MPI_BYTE, peer, 0, MPI_COMM_WORLD, s);
         mark_post();
         pos = 0;
         if (!has(empty)) wait(); 
         else test();
     }
 
-    const T get() {
+    void get(T *d) {
         assert(has(avail));
         assert(num < total);
         if (!has(avail)) wait();
-        auto p = data[first(avail)].at(pos);
+        auto p = &data[first(avail)].at(pos * width);
+        std::copy(p, p + width, d);
         pos = (pos + 1) % CS;
         if (pos == 0) { mark_free(); mpi_irecv(); }
 //        log() << ":get: num = " << num << " of " << total << std::endl;
         num++;
-        return p;
     }
 
     void mpi_irecv() {
@@ -118,7 +134,7 @@ struct SendRecvBuffer
             int c = mark_post();
             auto p = data.at(c).data();
             auto s = &req.at(c);
-            MPI_Irecv(p, CS * sizeof(T), MPI_BYTE, peer, 0, MPI_COMM_WORLD, s);
+            MPI_Irecv(p, CS * width * sizeof(T), MPI_BYTE, peer, 0, MPI_COMM_WORLD, s);
             posted++;
         }
 //        log() << ": posted " << posted << " irecv\n";
@@ -130,7 +146,7 @@ struct SendRecvBuffer
 template<typename T>
 struct SendBuffer : public SendRecvBuffer<T>
 {
-    SendBuffer(int p, int t) : SendRecvBuffer<T>(p,t) {}
+    SendBuffer(int p, int t, int w = 1) : SendRecvBuffer<T>(p,t,w) {}
     ~SendBuffer() { this->wait_all(); }
     void wait() { this->mpi_wait(); this->mark_sent(); }
     bool test() { bool b = this->mpi_test(); if (b) this->mark_sent(); return b;}
@@ -139,7 +155,8 @@ struct SendBuffer : public SendRecvBuffer<T>
 template<typename T>
 struct RecvBuffer : public SendRecvBuffer<T>
 {
-    RecvBuffer(int p, int t) : SendRecvBuffer<T>(p,t) { this->mpi_irecv(); }
+    RecvBuffer(int p, int t, int w = 1) : SendRecvBuffer<T>(p,t,w) { this->mpi_irecv(); }
+    void restart() { this->reset(); this->mpi_irecv(); }
     ~RecvBuffer() { this->wait_all(); }
     void wait() { this->mpi_wait(); this->mark_arrive(); }
     bool test() { bool b = (this->mpi_test()); if (b) this->mark_arrive(); return b;}
@@ -149,7 +166,11 @@ struct MPI_Sys : public Sys
 {
     //-- c'tor
     MPI_Sys(std::string name, std::string fname, std::string probename) : Sys(name, fname, probename) {}
-    MPI_Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &P) : Sys(name, M, P) {}
+    MPI_Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T) : Sys(name, M, T) {}
+    ~MPI_Sys() {
+        for(auto b : sb) delete b;
+        for(auto b : rb) delete b;
+    }
 
     //-- virtuals
     virtual void sample(Sys &in);
@@ -157,22 +178,33 @@ struct MPI_Sys : public Sys
     virtual void alloc_and_init();
 
     //-- local status
-    typedef std::pair<int,VectorNd> ElBuf;
-    std::vector<SendBuffer<ElBuf> *> sb;
-    std::vector<RecvBuffer<ElBuf> *> rb;
+    //   one element is the item index followed by its num_latent values
+    std::vector<SendBuffer<double> *> sb;
+    std::vector<RecvBuffer<double> *> rb;
+    std::vector<double> el;
+    void put_item(int to, int i);
+    void get_item(RecvBuffer<double> *b);
 
     //-- process_queue queue with protecting mutex
+    //   queue[queue_head:] are pending, the storage is reused
     std::mutex m;
-    std::list<int> queue;
+    std::vector<int> queue;
+    size_t queue_head = 0;
     void process_queue();
 };
 
 void MPI_Sys::sample(Sys &in)
 {
-    //Sys::cout() << Sys::procid << ": ------------ creating buffers --------------\n";
-    for(int i=0; i<Sys::nprocs; ++i) {
-        sb.push_back(new SendBuffer<ElBuf>(i, send_count(i)));
-        rb.push_back(new RecvBuffer<ElBuf>(i, recv_count(i)));
+    // the buffers are created in the first iteration and reused
+    if (sb.empty()) {
+        queue.reserve(num());
+        for(int i=0; i<Sys::nprocs; ++i) {
+            sb.push_back(new SendBuffer<double>(i, send_count(i), num_latent + 1));
+            rb.push_back(new RecvBuffer<double>(i, recv_count(i), num_latent + 1));
+        }
+    } else {
+        for(auto b : sb) b->reset();
+        for(auto b : rb) b->restart();
     }
 
     //Sys::cout() << Sys::procid << ": ------------ start compute --------------\n";
@@ -192,19 +224,13 @@ void MPI_Sys::sample(Sys &in)
         do {
             all_done = true;
             for(auto b : rb) {
-                while (b->has_data()) {
-                    auto el = b->get();
-                    items().col(el.first) = el.second;
-                }
+                while (b->has_data()) get_item(b);
                 all_done = all_done && b->done();
             }
         } while (!all_done);
     }
 
-    //Sys::cout() << Sys::procid << ": ------------ cleaning buffers --------------\n";
-
-    for(auto b : sb) { delete b; } sb.clear();
-    for(auto b : rb) { delete b; } rb.clear();
+    for(auto b : sb) b->wait_all();
     
     //Sys::cout() << Sys::procid << ": ------------ doing bcast --------------\n";
 
@@ -219,6 +245,22 @@ void MPI_Sys::sample(Sys &in)
     }
 }
 
+void MPI_Sys::put_item(int to, int i)
+{
+    el.resize(num_latent + 1);
+    el[0] = i;
+    std::copy(items().col(i).data(), items().col(i).data() + num_latent, &el[1]);
+    sb.at(to)->put(el.data());
+}
+
+void MPI_Sys::get_item(RecvBuffer<double> *b)
+{
+    el.resize(num_latent + 1);
+    b->get(el.data());
+    int i = el[0];
+    std::copy(&el[1], &el[1] + num_latent, items().col(i).data());
+}
+
 void MPI_Sys::send_items(int from, int to)
 {
     m.lock(); for(int i=from; i<to; ++i) queue.push_back(i); m.unlock();
@@ -235,25 +277,22 @@ void MPI_Sys::process_queue()
     {
         BPMF_COUNTER("process_queue");
 
-        int q = queue.size();
+        m.lock(); int q = queue.size() - queue_head; m.unlock();
         while (q--) {
             m.lock();
-            int i = queue.front();
-            queue.pop_front();
+            int i = queue[queue_head++];
+            if (queue_head == queue.size()) { queue.clear(); queue_head = 0; }
             m.unlock();
 
             // do some sends...
             for(int k = 0; k < Sys::nprocs; k++) {
                 if (!conn(i, k)) continue;
-                sb.at(k)->put(std::make_pair(i, items().col(i)));
+                put_item(k, i);
             }
 
             // do some recvs
             for(auto b : rb) {
-                while (b->has_data()) {
-                    auto el = b->get();
-                    items().col(el.first) = el.second;
-                }
+                while (b->has_data()) get_item(b);
             }
         }
     }
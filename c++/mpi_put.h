@@ -11,7 +11,7 @@ struct MPI_Sys : public Sys
 {
     //-- c'tor
     MPI_Sys(std::string name, std::string fname, std::string pname) : Sys(name,fname,pname) {}
-    MPI_Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &P) : Sys(name,M,P) {}
+    MPI_Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T) : Sys(name,M,T) {}
     virtual void alloc_and_init(const Sys &);
 
     virtual void send_items(int from, int to);
@@ -26,7 +26,7 @@ struct MPI_Sys : public Sys
 void MPI_Sys::alloc_and_init(const Sys &other)
 {
  
-    const int items_size = sizeof(double) * num_latent * num();
+    const int items_size = sizeof(ItemScalar) * num_latent_padded() * num();
     const int sum_size   = sizeof(double) * num_latent * Sys::nprocs;
     const int cov_size   = sizeof(double) * num_latent * num_latent * Sys::nprocs;
     const int norm_size  = sizeof(double) * Sys::nprocs;
@@ -36,7 +36,7 @@ void MPI_Sys::alloc_and_init(const Sys &other)
     MPI_Alloc_mem(cov_size,   MPI_INFO_NULL, &cov_ptr);
     MPI_Alloc_mem(norm_size,  MPI_INFO_NULL, &norm_ptr);
 
-    MPI_Win_create(items_ptr, items_size, sizeof(double), MPI_INFO_NULL, MPI_COMM_WORLD, &items_win); 
+    MPI_Win_create(items_ptr, items_size, sizeof(ItemScalar), MPI_INFO_NULL, MPI_COMM_WORLD, &items_win); 
     MPI_Win_create(sum_ptr,   sum_size,   sizeof(double), MPI_INFO_NULL, MPI_COMM_WORLD, &sum_win); 
     MPI_Win_create(cov_ptr,   cov_size,   sizeof(double), MPI_INFO_NULL, MPI_COMM_WORLD, &cov_win); 
     MPI_Win_create(norm_ptr,  norm_size,  sizeof(double), MPI_INFO_NULL, MPI_COMM_WORLD, &norm_win); 
@@ -57,9 +57,9 @@ void MPI_Sys::send_items(int from, int to)
     m.lock();
     for(int i=from; i<to; ++i) for(int k = 0; k < Sys::nprocs; k++) {
         if (k == Sys::procid) continue;
-        auto offset = i * num_latent;
+        auto offset = i * num_latent_padded();
         auto size = num_latent;
-        MPI_Put(items_ptr+offset, size, MPI_DOUBLE, k, offset, size, MPI_DOUBLE, items_win); 
+        MPI_Put(items_ptr+offset, size, BPMF_MPI_ITEM, k, offset, size, BPMF_MPI_ITEM, items_win); 
     }
     m.unlock();
 }
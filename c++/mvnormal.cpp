@@ -14,6 +14,7 @@
 #include <random>
 
 #include "bpmf.h"
+#include "rng.h"
 
 using namespace std;
 using namespace Eigen;
@@ -24,60 +25,85 @@ using namespace Eigen;
   it needs mutable state.
 */
 
-thread_vector<std::mt19937> r;
+thread_vector<Philox> r;
+static bool isinit = false;
 
-std::mt19937 &rng()
+void rng_seed(uint64_t seed)
 {
-    static bool isinit = false;
-    if (! isinit) {
-        r.init();
-        isinit=true;
-    }
+    r.init(Philox(seed));
+    isinit = true;
+}
+
+Philox &rng()
+{
+    if (! isinit) rng_seed(0);
     return r.local();
+}
+
+void rng_seek(uint32_t a, uint32_t b, uint32_t c)
+{
+    rng().seek(a, b, c);
+}
 
+void randn_fill(double *x, int n)
+{
+    randn_fill(rng(), x, n);
+}
+
+double rand_unif()
+{
+    return rng()() / 4294967296.0;
 }
 
 double randn(double = .0) {
-    normal_distribution<> nd;
-    return nd(rng());
+    double x;
+    randn_fill(&x, 1);
+    return x;
 }
 
-auto nrandn(int n) -> decltype( Eigen::VectorXd::NullaryExpr(n, ptr_fun(randn)) ) 
+Eigen::VectorXd nrandn(int n)
 {
-    return Eigen::VectorXd::NullaryExpr(n, ptr_fun(randn));
+    Eigen::VectorXd r(n);
+    randn_fill(r.data(), n);
+    return r;
 }
 
 /*
   Draw nn samples from a size-dimensional normal distribution
   with a specified mean and covariance
 */
-VectorNd MvNormalChol_prec(double kappa, const MatrixNNd & Lambda_U, const VectorNd & mean)
+template<int K>
+VectorNd<K> MvNormalChol_prec(double kappa, const MatrixNNd<K> & Lambda_U, const VectorNd<K> & mean)
 {
-  VectorNd r = VectorNd::NullaryExpr(ptr_fun(randn));
-  Lambda_U.triangularView<Upper>().solveInPlace(r);
+  VectorNd<K> r = nrandn<K>();
+  Lambda_U.template triangularView<Upper>().solveInPlace(r);
   return (r / sqrt(kappa)) + mean;
 }
 
 
-void WishartUnitChol(int df, MatrixNNd & c) {
-    c.setZero();
+template<int K>
+void WishartUnitChol(int df, MatrixNNd<K> & c) {
+    c.setZero(num_latent, num_latent);
 
+    // c is column major, the off-diagonals of row i go through r
+    VectorNd<K> r(num_latent);
     for ( int i = 0; i < num_latent; i++ ) {
         std::gamma_distribution<> gam(0.5*(df - i));
         c(i,i) = sqrt(2.0 * gam(rng()));
-        VectorXd r = nrandn(num_latent-i-1);
-        for(int j=i+1;j<num_latent;j++) c.coeffRef(i,j) = randn();
+        randn_fill(r.data(), num_latent-i-1);
+        c.row(i).tail(num_latent-i-1) = r.head(num_latent-i-1).transpose();
     }
 }
 
-void WishartChol(const MatrixNNd &sigma, const int df, MatrixNNd & U)
+template<int K>
+void WishartChol(const MatrixNNd<K> &sigma, const int df, MatrixNNd<K> & U)
 {
 //  Get R, the upper triangular Cholesky factor of SIGMA.
   auto chol = sigma.llt();
 
 //  Get AU, a sample from the unit Wishart distribution.
-  MatrixNNd au;
-  WishartUnitChol(df, au);
+  MatrixNNd<K> au;
+  WishartUnitChol<K>(df, au);
   U.noalias() = au * chol.matrixU();
 
 #ifdef TEST_MVNORMAL
@@ -91,11 +117,12 @@ void WishartChol(const MatrixNNd &sigma, const int df, MatrixNNd & U)
 
 
 // from julia package Distributions: conjugates/normalwishart.jl
-std::pair<VectorNd, MatrixNNd> NormalWishart(const VectorNd & mu, double kappa, const MatrixNNd & T, double nu)
+template<int K>
+std::pair<VectorNd<K>, MatrixNNd<K>> NormalWishart(const VectorNd<K> & mu, double kappa, const MatrixNNd<K> & T, double nu)
 {
-  MatrixNNd LamU;
-  WishartChol(T, nu, LamU);
-  VectorNd mu_o = MvNormalChol_prec(kappa, LamU, mu);
+  MatrixNNd<K> LamU;
+  WishartChol<K>(T, nu, LamU);
+  VectorNd<K> mu_o = MvNormalChol_prec<K>(kappa, LamU, mu);
 
 #ifdef TEST_MVNORMAL
     cout << "NORMAL WISHART {\n" << endl;
@@ -111,15 +138,16 @@ std::pair<VectorNd, MatrixNNd> NormalWishart(const VectorNd & mu, double kappa,
   return std::make_pair(mu_o , LamU);
 }
 
-std::pair<VectorNd, MatrixNNd> CondNormalWishart(const int N, const MatrixNNd &S, const VectorNd &Um, const VectorNd &mu, const double kappa, const MatrixNNd &T, const int nu)
+template<int K>
+std::pair<VectorNd<K>, MatrixNNd<K>> CondNormalWishart(const int N, const MatrixNNd<K> &S, const VectorNd<K> &Um, const VectorNd<K> &mu, const double kappa, const MatrixNNd<K> &T, const int nu)
 {
     auto mu_m = (mu - Um);
-    VectorNd mu_c = (kappa*mu + N*Um) / (kappa + N);
+    VectorNd<K> mu_c = (kappa*mu + N*Um) / (kappa + N);
 
     double kappa_c = kappa + N;
     double kappa_m = (kappa * N)/(kappa + N);
     auto X = ( T + N * S + kappa_m * (mu_m * mu_m.transpose()));
-    MatrixNNd T_c = X.inverse();
+    MatrixNNd<K> T_c = X.inverse();
     int nu_c = nu + N;
 
 #ifdef TEST_MVNORMAL
@@ -129,5 +157,12 @@ std::pair<VectorNd, MatrixNNd> CondNormalWishart(const int N, const MatrixNNd &S
     cout << "nu_c:\n" << nu_c << endl;
 #endif
 
-    return NormalWishart(mu_c, kappa_c, T_c, nu_c);
+    return NormalWishart<K>(mu_c, kappa_c, T_c, nu_c);
 }
+
+#define BPMF_INSTANTIATE_CNW(K, X) \
+    template std::pair<VectorNd<K>, MatrixNNd<K>> CondNormalWishart<K>(const int, const MatrixNNd<K> &, const VectorNd<K> &, \
+        const VectorNd<K> &, const double, const MatrixNNd<K> &, const int);
+
+BPMF_FOR_EACH_NUMLATENT(BPMF_INSTANTIATE_CNW, _)
+BPMF_INSTANTIATE_CNW(Eigen::Dynamic, _)
@@ -9,7 +9,7 @@ struct NC_Sys : public Sys
 {
     //-- c'tor
     NC_Sys(std::string name, std::string fname, std::string probename) : Sys(name, fname, probename) {}
-    NC_Sys(std::string name, const SparseMatrixD &M, const SparseMatrixD &P) : Sys(name, M, P) {}
+    NC_Sys(std::string name, const RatingMatrix &M, std::shared_ptr<TestMatrix> T) : Sys(name, M, T) {}
     virtual void alloc_and_init();
 
     virtual void send_items(int, int) {}
@@ -32,7 +32,7 @@ void Sys::Finalize()
 
 void NC_Sys::alloc_and_init()
 {
-    items_ptr = (double *)malloc(sizeof(double) * num_latent * num());
+    items_ptr = alloc_items(num());
     sum_ptr = (double *)malloc(sizeof(double) * num_latent * NC_Sys::nprocs);
     cov_ptr = (double *)malloc(sizeof(double) * num_latent * num_latent * NC_Sys::nprocs);
     norm_ptr = (double *)malloc(sizeof(double) * NC_Sys::nprocs);
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <sstream>
+#include <unordered_map>
+
+#include "error.h"
+#include "ratings.h"
+
+RatingMatrix::RatingMatrix(const SparseMatrixD &m)
+    : nrows(m.rows()), ncols(m.cols()), kind(Constant), outer(m.cols() + 1), inner(m.nonZeros())
+{
+    if (m.rows() > INT_MAX || m.cols() > INT_MAX) THROWERROR("More than 2^31 - 1 rows or columns");
+
+    // the smallest storage that holds all values exactly
+    std::unordered_map<double, int> index;
+    for (int k = 0; k < m.outerSize() && index.size() <= 256; ++k)
+        for (SparseMatrixD::InnerIterator it(m, k); it && index.size() <= 256; ++it)
+            if (index.emplace(it.value(), (int)index.size()).second) codebook.push_back(it.value());
+
+    if (index.size() > 256) { kind = Plain; codebook.clear(); }
+    else if (index.size() > 1) kind = Coded;
+    else if (index.empty()) codebook.push_back(0.0);
+    resize_values();
+
+    long p = 0;
+    outer[0] = 0;
+    for (int k = 0; k < m.outerSize(); ++k)
+    {
+        for (SparseMatrixD::InnerIterator it(m, k); it; ++it, ++p)
+        {
+            inner[p] = it.row();
+            if (kind == Coded) codes[p] = index[it.value()];
+            else if (kind == Plain) plain[p] = it.value();
+        }
+        outer[k + 1] = p;
+    }
+}
+
+void RatingMatrix::resize_values()
+{
+    codes.resize(kind == Coded ? inner.size() : 0);
+    plain.resize(kind == Plain ? inner.size() : 0);
+}
+
+void RatingMatrix::values(long from, long to, double *out) const
+{
+    switch (kind)
+    {
+        case Coded: for (long p = from; p < to; ++p) *out++ = codebook[codes[p]]; break;
+        case Plain: std::copy(plain.begin() + from, plain.begin() + to, out); break;
+        default:    std::fill(out, out + (to - from), codebook[0]);
+    }
+}
+
+double RatingMatrix::sum() const
+{
+    double s = 0.0;
+    for (long p = 0; p < nonZeros(); ++p) s += value(p);
+    return s;
+}
+
+RatingMatrix RatingMatrix::operator*(const PermMatrix &perm) const
+{
+    RatingMatrix r(*this);
+    long q = 0;
+    for (int k = 0; k < ncols; ++k)
+    {
+        const int c = perm.indices()(k);
+        for (long p = outer[c]; p < outer[c + 1]; ++p, ++q)
+        {
+            r.inner[q] = inner[p];
+            copy_value(p, r, q);
+        }
+        r.outer[k + 1] = q;
+    }
+    return r;
+}
+
+// counting sort by row, the row indices of the result stay sorted
+RatingMatrix RatingMatrix::transpose() const
+{
+    RatingMatrix t;
+    t.nrows = ncols;
+    t.ncols = nrows;
+    t.kind = kind;
+    t.codebook = codebook;
+    t.inner.resize(inner.size());
+    t.resize_values();
+
+    t.outer.assign(nrows + 1, 0);
+    for (long p = 0; p < nonZeros(); ++p) t.outer[inner[p] + 1]++;
+    for (int r = 0; r < nrows; ++r) t.outer[r + 1] += t.outer[r];
+
+    std::vector<SparseIndex> next(t.outer.begin(), t.outer.end() - 1);
+    for (int k = 0; k < ncols; ++k)
+    {
+        for (long p = outer[k]; p < outer[k + 1]; ++p)
+        {
+            const long q = next[inner[p]]++;
+            t.inner[q] = k;
+            copy_value(p, t, q);
+        }
+    }
+    return t;
+}
+
+std::string RatingMatrix::describe() const
+{
+    std::stringstream ss;
+    const double index_bytes = sizeof(int) + (double)sizeof(SparseIndex) * (ncols + 1) / std::max(nonZeros(), 1L);
+    switch (kind)
+    {
+        case Coded: ss << "coded (" << codebook.size() << " values), " << index_bytes + sizeof(uint8_t); break;
+        case Plain: ss << "plain, " << index_bytes + sizeof(double); break;
+        default:    ss << "constant (" << codebook[0] << "), " << index_bytes;
+    }
+    ss << " bytes/rating";
+    return ss.str();
+}
+
+TestMatrix::TestMatrix(const SparseMatrixD &m)
+    : nrows(m.rows()), ncols(m.cols()), col_ptr(m.cols() + 1), row_idx(m.nonZeros()), value(m.nonZeros())
+{
+    long p = 0;
+    col_ptr[0] = 0;
+    for (int k = 0; k < m.outerSize(); ++k)
+    {
+        for (SparseMatrixD::InnerIterator it(m, k); it; ++it, ++p)
+        {
+            row_idx[p] = it.row();
+            value[p] = it.value();
+        }
+        col_ptr[k + 1] = p;
+    }
+
+    Pm2 = Pavg = value;
+    build_csr();
+}
+
+// counting sort of the CSC by row
+void TestMatrix::build_csr()
+{
+    row_ptr.assign(nrows + 1, 0);
+    col_idx.resize(nonZeros());
+    csr_pos.resize(nonZeros());
+
+    for (long p = 0; p < nonZeros(); ++p) row_ptr[row_idx[p] + 1]++;
+    for (int r = 0; r < nrows; ++r) row_ptr[r + 1] += row_ptr[r];
+
+    std::vector<SparseIndex> next(row_ptr.begin(), row_ptr.end() - 1);
+    for (int k = 0; k < ncols; ++k)
+    {
+        for (long p = col_ptr[k]; p < col_ptr[k + 1]; ++p)
+        {
+            const long q = next[row_idx[p]]++;
+            col_idx[q] = k;
+            csr_pos[q] = p;
+        }
+    }
+}
+
+void TestMatrix::permute(const PermMatrix &perm, bool by_row)
+{
+    std::vector<SparseIndex> from(nonZeros()), ptr(ncols + 1, 0);
+    std::vector<int> idx(nonZeros());
+    long q = 0;
+
+    if (!by_row)
+    {
+        for (int k = 0; k < ncols; ++k)
+        {
+            const int c = perm.indices()(k);
+            for (long p = col_ptr[c]; p < col_ptr[c + 1]; ++p, ++q)
+            {
+                idx[q] = row_idx[p];
+                from[q] = p;
+            }
+            ptr[k + 1] = q;
+        }
+    }
+    else
+    {
+        // new row k is row perm(k): counting sort of the permuted CSR by column
+        for (long p = 0; p < nonZeros(); ++p) ptr[col_idx[p] + 1]++;
+        for (int c = 0; c < ncols; ++c) ptr[c + 1] += ptr[c];
+
+        std::vector<SparseIndex> next(ptr.begin(), ptr.end() - 1);
+        for (int k = 0; k < nrows; ++k)
+        {
+            const int r = perm.indices()(k);
+            for (long p = row_ptr[r]; p < row_ptr[r + 1]; ++p)
+            {
+                q = next[col_idx[p]]++;
+                idx[q] = k;
+                from[q] = csr_pos[p];
+            }
+        }
+    }
+
+    col_ptr.swap(ptr);
+    row_idx.swap(idx);
+    gather(value, from);
+    gather(Pavg, from);
+    gather(Pm2, from);
+    build_csr();
+}
+
+void TestMatrix::gather(std::vector<double> &v, const std::vector<SparseIndex> &from)
+{
+    std::vector<double> g(from.size());
+    for (size_t i = 0; i < from.size(); ++i) g[i] = v[from[i]];
+    v.swap(g);
+}
+
+SparseMatrixD TestMatrix::sparse(const std::vector<double> &v, bool by_row) const
+{
+    SparseMatrixD m(nrows, ncols);
+    m.reserve(nonZeros());
+    for (int k = 0; k < ncols; ++k)
+    {
+        m.startVec(k);
+        for (long p = col_ptr[k]; p < col_ptr[k + 1]; ++p) m.insertBack(row_idx[p], k) = v[p];
+    }
+    m.finalize();
+
+    if (by_row) return m.transpose();
+    return m;
+}
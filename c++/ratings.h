@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "io.h"
+
+//
+// Compressed sparse column matrix of the training ratings (Sys::M)
+//
+// Per rating only its 32-bit row index is stored, plus its value in the most
+// compact form that is exact:
+//   Constant: no value at all, all ratings are equal (binary .sbm input)
+//   Coded:    one byte, an index in a codebook of at most 256 values (star ratings)
+//   Plain:    one double
+// Discrete ratings take 5 bytes instead of the 12 of Eigen::SparseMatrix<double>.
+//
+class RatingMatrix
+{
+  public:
+    enum Kind { Constant, Coded, Plain };
+    typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> PermMatrix;
+
+    RatingMatrix() : nrows(0), ncols(0), kind(Constant), outer(1, 0), codebook(1, 0.0) {}
+    explicit RatingMatrix(const SparseMatrixD &m);
+
+    int rows() const { return nrows; }
+    int cols() const { return ncols; }
+    long nonZeros() const { return outer[ncols]; }
+    int nnz(int col) const { return outer[col + 1] - outer[col]; }
+
+    // column col holds the ratings [outerIndexPtr()[col], outerIndexPtr()[col + 1])
+    const SparseIndex *outerIndexPtr() const { return outer.data(); }
+    const int *innerIndexPtr() const { return inner.data(); }
+
+    // value of rating p
+    double value(long p) const
+    {
+        switch (kind)
+        {
+            case Coded: return codebook[codes[p]];
+            case Plain: return plain[p];
+            default:    return codebook[0];
+        }
+    }
+
+    // values of the ratings [from, to) in out[0, to - from)
+    void values(long from, long to, double *out) const;
+
+    double sum() const;
+
+    // same as Eigen: column i of the result is column perm.indices()(i)
+    RatingMatrix operator*(const PermMatrix &perm) const;
+    RatingMatrix transpose() const;
+
+    // storage and number of bytes per rating, for the log
+    std::string describe() const;
+
+    class InnerIterator
+    {
+      public:
+        InnerIterator(const RatingMatrix &m, int col) : m(m), c(col), p(m.outer[col]), end(m.outer[col + 1]) {}
+        operator bool() const { return p < end; }
+        InnerIterator &operator++() { ++p; return *this; }
+        int row() const { return m.inner[p]; }
+        int col() const { return c; }
+        double value() const { return m.value(p); }
+
+      private:
+        const RatingMatrix &m;
+        int c;
+        long p, end;
+    };
+
+  private:
+    int nrows, ncols;
+    Kind kind;
+    std::vector<SparseIndex> outer;
+    std::vector<int> inner;
+    std::vector<uint8_t> codes;   // Coded
+    std::vector<double> plain;    // Plain
+    std::vector<double> codebook; // Coded, the value in codebook[0] if Constant
+
+    // value of rating p to rating q of t, with the same codebook
+    void copy_value(long p, RatingMatrix &t, long q) const
+    {
+        if (kind == Coded) t.codes[q] = codes[p];
+        else if (kind == Plain) t.plain[q] = plain[p];
+    }
+    void resize_values();
+};
+
+//
+// Test ratings, shared by the two Sys of a factorization
+//
+// The pattern is stored once in each orientation: by column (CSC) for the Sys
+// whose items are the columns, by row (CSR) for the other one. The nonzeros
+// are numbered in CSC order; the test ratings and the prediction statistics
+// (Pavg, Pm2) are flat in that order, and the CSR keeps the number of each of
+// its nonzeros.
+//
+class TestMatrix
+{
+  public:
+    typedef RatingMatrix::PermMatrix PermMatrix;
+
+    explicit TestMatrix(const SparseMatrixD &m);
+
+    int rows() const { return nrows; }
+    int cols() const { return ncols; }
+    long nonZeros() const { return col_ptr[ncols]; }
+
+    // number of ratings of column k, or of row k if by_row
+    int nnz(int k, bool by_row) const { return by_row ? row_ptr[k + 1] - row_ptr[k] : col_ptr[k + 1] - col_ptr[k]; }
+
+    // the pattern by column (CSC), or by row (CSR) if by_row: the ratings of
+    // column (row) k are [outerIndexPtr()[k], outerIndexPtr()[k + 1]), and
+    // the j-th one is nonzero number pos(j)
+    const SparseIndex *outerIndexPtr(bool by_row) const { return by_row ? row_ptr.data() : col_ptr.data(); }
+    const int *innerIndexPtr(bool by_row) const { return by_row ? col_idx.data() : row_idx.data(); }
+    long pos(long j, bool by_row) const { return by_row ? csr_pos[j] : j; }
+
+    // test ratings, by nonzero number
+    const std::vector<double> &values() const { return value; }
+
+    // running mean and M2 (sum of squared deviations) of the predicted ratings,
+    // by nonzero number, updated by Sys::predict (output)
+    std::vector<double> Pavg, Pm2;
+
+    // reorders the columns, or the rows if by_row, as m * perm, and renumbers
+    // the nonzeros, with Pavg and Pm2
+    void permute(const PermMatrix &perm, bool by_row);
+
+    // v, aligned with the nonzeros, as sparse matrix, transposed if by_row
+    SparseMatrixD sparse(const std::vector<double> &v, bool by_row) const;
+
+    // ratings of column k, or of row k if by_row: row() is the other index
+    class InnerIterator
+    {
+      public:
+        InnerIterator(const TestMatrix &m, int k, bool by_row)
+            : m(m), by_row(by_row), k(k), p(by_row ? m.row_ptr[k] : m.col_ptr[k]),
+              end(by_row ? m.row_ptr[k + 1] : m.col_ptr[k + 1]) {}
+        operator bool() const { return p < end; }
+        InnerIterator &operator++() { ++p; return *this; }
+        int row() const { return by_row ? m.col_idx[p] : m.row_idx[p]; }
+        int col() const { return k; }
+        long pos() const { return by_row ? m.csr_pos[p] : p; }
+        double value() const { return m.value[pos()]; }
+
+      private:
+        const TestMatrix &m;
+        bool by_row;
+        int k;
+        long p, end;
+    };
+
+  private:
+    int nrows, ncols;
+    std::vector<SparseIndex> col_ptr; std::vector<int> row_idx;          // CSC
+    std::vector<SparseIndex> row_ptr, csr_pos; std::vector<int> col_idx; // CSR, with the number of each nonzero
+    std::vector<double> value;
+
+    void build_csr();
+
+    // v[i] = v[from[i]]
+    static void gather(std::vector<double> &v, const std::vector<SparseIndex> &from);
+};
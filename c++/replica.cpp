@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <algorithm>
+
+#include "bpmf.h"
+
+#ifdef BPMF_NUMA
+#include <numa.h>
+#include <sched.h>
+#endif
+
+bool Sys::replicate_items = false;
+
+#ifdef BPMF_NUMA
+// NUMA node of the calling thread, looked up once: the threads do not move once pinned
+static int this_node()
+{
+    thread_local int node = numa_node_of_cpu(sched_getcpu());
+    return node;
+}
+
+static size_t items_bytes(const Sys &s) { return sizeof(ItemScalar) * num_latent_padded() * s.num(); }
+#endif
+
+//
+// copies the items to a replica on each NUMA node, the pages of replica n are
+// bound to node n whatever thread copies them
+//
+void Sys::replicate()
+{
+#ifdef BPMF_NUMA
+    if (!replicate_items || numa_available() < 0 || numa_max_node() < 1) return;
+
+    if (replicas.empty()) {
+        replicas.resize(numa_max_node() + 1);
+        for(size_t n = 0; n < replicas.size(); ++n)
+            replicas[n] = (ItemScalar *)numa_alloc_onnode(items_bytes(*this), n);
+    }
+
+    const long ld = num_latent_padded();
+    for(auto r : replicas) {
+        if (!r) continue;
+        #pragma omp parallel for schedule(static)
+        for(int i = 0; i < num(); ++i)
+            std::copy(items_ptr + i * ld, items_ptr + (i + 1) * ld, r + i * ld);
+    }
+#endif
+}
+
+void Sys::free_replicas()
+{
+#ifdef BPMF_NUMA
+    for(auto r : replicas)
+        if (r) numa_free(r, items_bytes(*this));
+#endif
+    replicas.clear();
+}
+
+ItemScalar *Sys::near_items_ptr() const
+{
+#ifdef BPMF_NUMA
+    if (!replicas.empty()) {
+        const int node = this_node();
+        if (node >= 0 && node < (int)replicas.size() && replicas[node]) return replicas[node];
+    }
+#endif
+    return items_ptr;
+}
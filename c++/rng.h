@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+//
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3", SC'11). Block n of stream (a, b, c) is a pure
+// function of the key (the seed) and the counter (n, a, b, c). Keyed by what
+// is sampled instead of by who samples it, the draws do not depend on the
+// number of threads or processes, or on the schedule.
+//
+// Meets the UniformRandomBitGenerator requirements of the std:: distributions.
+//
+class Philox
+{
+  public:
+    typedef uint32_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+    explicit Philox(uint64_t seed = 0)
+    {
+        key[0] = (uint32_t)seed;
+        key[1] = (uint32_t)(seed >> 32);
+        seek(0, 0, 0);
+    }
+
+    // restarts at the beginning of stream (a, b, c)
+    void seek(uint32_t a, uint32_t b, uint32_t c)
+    {
+        ctr[0] = 0; ctr[1] = a; ctr[2] = b; ctr[3] = c;
+        pos = 4;
+    }
+
+    result_type operator()()
+    {
+        if (pos == 4)
+        {
+            generate();
+            ctr[0]++;
+            pos = 0;
+        }
+        return out[pos++];
+    }
+
+  private:
+    uint32_t key[2], ctr[4], out[4];
+    int pos;
+
+    void generate()
+    {
+        uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int r = 0; r < 10; ++r)
+        {
+            const uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+            const uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+};
+
+//
+// n standard normal deviates from g, Box-Muller on four 32-bit uniforms per
+// Philox block: no rejection branch as in std::normal_distribution, and the
+// log/sqrt/sin/cos loops over a whole block of 64 are vectorizable
+// (with -ffast-math GCC calls the glibc vector math functions)
+//
+inline void randn_fill(Philox &g, double *x, int n)
+{
+    const int B = 64;
+    const double scale = 1.0 / 4294967296.0;
+    const double two_pi = 6.283185307179586;
+    double u[B], v[B];
+
+    for (int i = 0; i < n; i += B)
+    {
+        const int m = (n - i < B) ? n - i : B;
+        const int h = (m + 1) / 2; // pairs
+        for (int j = 0; j < h; ++j)
+        {
+            u[j] = (g() + 0.5) * scale; // in (0, 1)
+            v[j] = (g() + 0.5) * scale;
+        }
+
+        // separate loops, GCC does not vectorize sincos
+        #pragma omp simd
+        for (int j = 0; j < h; ++j) u[j] = std::sqrt(-2.0 * std::log(u[j]));
+
+        double *y = x + i;
+        const int p = m / 2;
+        #pragma omp simd
+        for (int j = 0; j < h; ++j) y[j] = u[j] * std::cos(two_pi * v[j]);
+        #pragma omp simd
+        for (int j = 0; j < p; ++j) y[h + j] = u[j] * std::sin(two_pi * v[j]);
+    }
+}
+
+// stable 32-bit id of a name, to key the streams of a Sys (FNV-1a)
+inline uint32_t rng_hash(const std::string &name)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : name) h = (h ^ c) * 16777619u;
+    return h;
+}
+
+// (re)initializes the generators of all threads with seed
+void rng_seed(uint64_t seed);
+
+// moves the generator of the calling thread to stream (a, b, c)
+void rng_seek(uint32_t a, uint32_t b, uint32_t c);
+
+// n standard normal deviates from the generator of the calling thread
+void randn_fill(double *x, int n);
+
+// uniform deviate in [0, 1) from the generator of the calling thread
+double rand_unif();
@@ -6,24 +6,35 @@
 #include "error.h"
 #include "bpmf.h"
 
+#include <algorithm>
 #include <random>
 #include <memory>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <climits>
 #include <stdexcept>
+#include <type_traits>
 
 #include "io.h"
+#include "gram.h"
+#include "smallchol.h"
+#include "sddmm.h"
 
 #if defined(_OPENMP)
 #include "omp.h"
-
-#pragma omp declare reduction (VectorPlus : VectorNd : omp_out += omp_in) initializer(omp_priv = VectorNd::Zero())
-#pragma omp declare reduction (MatrixPlus : MatrixNNd : omp_out += omp_in) initializer(omp_priv = MatrixNNd::Zero())
 #endif
 
+// declared inside the K-templated functions that use them
+#define BPMF_DECLARE_REDUCTIONS(K) \
+    _Pragma("omp declare reduction (VectorPlus : VectorNd<K> : omp_out += omp_in) initializer(omp_priv = VectorNd<K>::Zero(omp_orig.size()))") \
+    _Pragma("omp declare reduction (MatrixPlus : MatrixNNd<K> : omp_out += omp_in) initializer(omp_priv = MatrixNNd<K>::Zero(omp_orig.rows(), omp_orig.cols()))") \
+    _Pragma("omp declare reduction (PackedPlus : PackedNd<K> : omp_out += omp_in) initializer(omp_priv = PackedNd<K>::Zero(omp_orig.size()))")
+
 static const bool measure_perf = false;
 
+int num_latent = BPMF_NUMLATENT;
+
 std::ostream *Sys::os;
 int Sys::procid = -1;
 int Sys::nprocs = -1;
@@ -38,69 +49,257 @@ bool Sys::permute = true;
 bool Sys::verbose = false;
 
 unsigned Sys::grain_size;
+bool Sys::sort_by_cost = false;
+
+int Sys::breakpoint0 = -1; // set to num_latent in main
+int Sys::breakpoint1 = 24;
+int Sys::breakpoint2 = 10500;
+int Sys::breakpoint_batch = 0;
+
+int Sys::eval_every = 1;
+bool Sys::train_monitor = false;
+double Sys::eval_fraction = 0.0;
 
-void calc_upper_part(MatrixNNd &m, VectorNd v);         // function for calcutation of an upper part of a symmetric matrix: m = v * v.transpose(); 
-void copy_lower_part(MatrixNNd &m);                     // function to copy an upper part of a symmetric matrix to a lower part
+// number of samples before iteration iter in the running means of the predictions
+static int avg_count(int iter) { return (iter < Sys::burnin) ? 0 : (iter - Sys::burnin); }
 
-// verifies that A has the same non-zero structure as B
-void assert_same_struct(SparseMatrixD &A, SparseMatrixD &B)
+// adds prediction pred to a running mean and M2, the first one (n == 0) restarts them
+static inline void update_prediction(double pred, int n, double &avg, double &m2)
 {
-    assert(A.cols() == B.cols());
-    assert(A.rows() == B.rows());
-    for(int i=0; i<A.cols(); ++i) assert(A.col(i).nonZeros() == B.col(i).nonZeros());
+    double delta = pred - avg;
+    avg = (n == 0) ? pred : (avg + delta/n);
+    m2 = (n == 0) ? 0 : m2 + delta * (pred - avg);
+}
+
+// half width of the 95% confidence interval of an RMSE from n squared errors
+// with sum se and sum of squares se2 (delta method)
+static double rmse_ci95(double se, double se2, long n)
+{
+    const double mse = se / n;
+    const double var = std::max(se2 / n - mse * mse, 0.0);
+    return 1.96 * std::sqrt(var / n) / (2.0 * std::sqrt(mse));
 }
 
 //
-// Does predictions for prediction matrix T
+// Does predictions for prediction matrix T, shared with other:
+// one pass updates the running mean of each prediction in T->Pavg
 // Computes RMSE (Root Means Square Error)
 //
 void Sys::predict(Sys& other, bool all)
 {
-    int n = (iter < burnin) ? 0 : (iter - burnin);
-   
+    if (avg_count(iter) == 0) nhistory = 0; // restarted anyway
+
     double se(0.0); // squared err
     double se_avg(0.0); // squared avg err
-    unsigned nump(0); // number of predictions
+    long nump(0); // number of predictions
 
     int lo = all ? 0 : from();
     int hi = all ? num() : to();
-    #pragma omp parallel for reduction(+:se,se_avg,nump)
-    for(int k = lo; k<hi; k++) {
-        for (Eigen::SparseMatrix<double>::InnerIterator it(T,k); it; ++it)
-        {
-            auto m = items().col(it.col());
-            auto u = other.items().col(it.row());
+    const SparseIndex *ptr = T->outerIndexPtr(T_by_row);
+    const int block = 256;
+    #pragma omp parallel for reduction(+:se,se_avg,nump) schedule(dynamic)
+    for(int c0 = lo; c0 < hi; c0 += block) {
+        const int c1 = std::min(c0 + block, hi);
+        std::vector<double> dot(ptr[c1] - ptr[c0]);
+        sddmm(num_latent, items_ptr, num_latent_padded(), other.items_ptr, num_latent_padded(), other.num(),
+              ptr, T->innerIndexPtr(T_by_row), c0, c1, dot.data());
+        for(int k = c0; k < c1; ++k)
+            update_predictions(k, ptr[k], ptr[k + 1], dot.data() + (ptr[k] - ptr[c0]), se, se_avg, nump);
+    }
+    nhistory = 0;
+
+    if (nump) {
+        rmse = sqrt( se / nump );
+        rmse_avg = sqrt( se_avg / nump );
+        rmse_ci = rmse_avg_ci = 0.0;
+        rmse_iter = iter;
+    }
+}
+
+//
+// Predicts the test ratings of item k with the items of other, the other Sys
+//
+void Sys::predict_item(int k, const ItemScalar *other, double &se, double &se_avg, long &nump)
+{
+    const SparseIndex *ptr = T->outerIndexPtr(T_by_row);
+    const int *idx = T->innerIndexPtr(T_by_row);
+    const int chunk = 64;
+    double dot[chunk];
+
+    for(long from = ptr[k]; from < ptr[k + 1]; from += chunk) {
+        const long to = std::min(from + chunk, (long)ptr[k + 1]);
+        sddmm_column(num_latent, items_ptr + k * num_latent_padded(), other, num_latent_padded(), idx + from, to - from, dot);
+        update_predictions(k, from, to, dot, se, se_avg, nump);
+    }
+}
 
-            assert(m.norm() > 0.0);
-            assert(u.norm() > 0.0);
+//
+// Updates the average prediction of the test ratings [from, to) of item k,
+// in the storage of T, from dot = their u' * v, and adds their squared
+// errors to se and se_avg
+//
+// The samples kept by defer_predict go into the average first, in the
+// same order and with the same arithmetic as if they had been predicted
+// in their own iteration
+//
+void Sys::update_predictions(int k, long from, long to, const double *dot, double &se, double &se_avg, long &nump)
+{
+    const int n = avg_count(iter);
+    const long ld = num_latent_padded();
+    const int *idx = T->innerIndexPtr(T_by_row);
+    const double *value = T->values().data();
+    double *Pavg = T->Pavg.data(), *Pm2 = T->Pm2.data();
+
+    for(long j = from; j < to; ++j)
+    {
+        const long p = T->pos(j, T_by_row);
+        double &avg = Pavg[p];
+        double &m2 = Pm2[p];
+
+        // the subsample is up to date
+        if (nhistory && (in_subsample.empty() || !in_subsample[p])) {
+            for (int h = 0; h < nhistory; ++h) {
+                const Snapshot &s = history[h];
+                double d;
+                sddmm_column(num_latent, s.items.data() + k * ld, s.other.data(), ld, idx + j, 1, &d);
+                update_prediction(d + mean_rating, s.n, avg, m2);
+            }
+        }
+
+        const double pred = dot[j - from] + mean_rating;
+        se += sqr(value[p] - pred);
+
+        // update average prediction
+        update_prediction(pred, n, avg, m2);
+        se_avg += sqr(value[p] - avg);
+
+        nump++;
+    }
+}
+
+//
+// Keeps the current sample of this Sys and of other for the next predict,
+// and scores the subsample of -S
+//
+void Sys::defer_predict(Sys& other)
+{
+    // a first sample restarts the running means, the older ones are not needed
+    if (avg_count(iter) == 0) nhistory = 0;
+
+    if (nhistory == (int)history.size()) history.emplace_back();
+    Snapshot &s = history[nhistory++];
+    const long ld = num_latent_padded();
+    s.n = avg_count(iter);
+    s.items.assign(items_ptr, items_ptr + ld * num());
+    s.other.assign(other.items_ptr, other.items_ptr + ld * other.num());
 
-            const double pred = m.dot(u) + mean_rating;
-            se += sqr(it.value() - pred);
+    if (eval_fraction > 0.0) predict_subsample(other);
+}
 
-            // update average prediction
-            double &avg = Pavg.coeffRef(it.row(), it.col());
-            double delta = pred - avg;
-            avg = (n == 0) ? pred : (avg + delta/n);
-            double &m2 = Pm2.coeffRef(it.row(), it.col());
-            m2 = (n == 0) ? 0 : m2 + delta * (pred - avg);
-            se_avg += sqr(it.value() - avg);
+//
+// Replays the kept samples into Pavg and Pm2, right after defer_predict:
+// the last kept sample is the current one
+//
+void Sys::flush_predict(Sys& other)
+{
+    if (nhistory == 0) return;
+    nhistory--;
+    predict(other);
+}
 
-            nump++;
+//
+// Scores a fixed random subsample of the local test ratings and updates
+// their average prediction, the RMSEs come with a confidence interval
+//
+void Sys::predict_subsample(Sys& other)
+{
+    // drawn once, the same whatever the number of processes
+    if (in_subsample.empty()) {
+        in_subsample.assign(T->nonZeros(), 0);
+        for(int k = from(); k < to(); ++k) {
+            rng_seek(rng_id, UINT32_MAX, orig_col(k));
+            for (TestMatrix::InnerIterator it(*T, k, T_by_row); it; ++it) {
+                if (rand_unif() >= eval_fraction) continue;
+                subsample.push_back({k, it.row(), it.pos()});
+                in_subsample[it.pos()] = 1;
+            }
         }
     }
 
+    const int n = avg_count(iter);
+    const long ld = num_latent_padded();
+    const double *value = T->values().data();
+    double *Pavg = T->Pavg.data(), *Pm2 = T->Pm2.data();
+    double se(0.0), se2(0.0), se_avg(0.0), se_avg2(0.0);
+    const long nump = subsample.size();
+    if (nump == 0) return;
+
+    #pragma omp parallel for reduction(+:se,se2,se_avg,se_avg2)
+    for(long j = 0; j < nump; ++j) {
+        const TestRating &t = subsample[j];
+        double d;
+        sddmm_column(num_latent, items_ptr + t.item * ld, other.items_ptr, ld, &t.other, 1, &d);
+        const double pred = d + mean_rating;
+        update_prediction(pred, n, Pavg[t.pos], Pm2[t.pos]);
+
+        const double e = sqr(value[t.pos] - pred), e_avg = sqr(value[t.pos] - Pavg[t.pos]);
+        se += e;
+        se2 += e * e;
+        se_avg += e_avg;
+        se_avg2 += e_avg * e_avg;
+    }
+
     rmse = sqrt( se / nump );
     rmse_avg = sqrt( se_avg / nump );
+    rmse_ci = rmse_ci95(se, se2, nump);
+    rmse_avg_ci = rmse_ci95(se_avg, se_avg2, nump);
+    rmse_iter = iter;
+}
+
+//
+// Training RMSE and log-likelihood of the ratings of the local items with
+// the items of other, the other Sys (-L)
+//
+void Sys::train_eval(Sys& other)
+{
+    const SparseIndex *ptr = M.outerIndexPtr();
+    const int block = 256;
+    double se(0.0);
+
+    #pragma omp parallel for reduction(+:se) schedule(dynamic)
+    for(int c0 = from(); c0 < to(); c0 += block) {
+        const int c1 = std::min(c0 + block, to());
+        const long n = ptr[c1] - ptr[c0];
+        std::vector<double> dot(n), val(n);
+        sddmm(num_latent, items_ptr, num_latent_padded(), other.items_ptr, num_latent_padded(), other.num(),
+              ptr, M.innerIndexPtr(), c0, c1, dot.data());
+        M.values(ptr[c0], ptr[c1], val.data());
+        for(long j = 0; j < n; ++j) se += sqr(val[j] - mean_rating - dot[j]);
+    }
+
+    // Gaussian noise with precision alpha
+    const long n = ptr[to()] - ptr[from()];
+    train_rmse = sqrt( se / n );
+    train_loglik = 0.5 * n * log(alpha / (2.0 * M_PI)) - 0.5 * alpha * se;
+    train_iter = iter;
 }
 
 //
 // Prints sampling progress
 //
 void Sys::print(double items_per_sec, double ratings_per_sec, double norm_u, double norm_m) {
-  char buf[1024];
+  char buf[1024], err[256];
   std::string phase = (iter < Sys::burnin) ? "Burnin" : "Sampling";
-  sprintf(buf, "%d: %s iteration %d:\t RMSE: %3.4f\tavg RMSE: %3.4f\tFU(%6.2f)\tFM(%6.2f)\titems/sec: %6.2f\tratings/sec: %6.2fM\n",
-                    Sys::procid, phase.c_str(), iter, rmse, rmse_avg, norm_u, norm_m, items_per_sec, ratings_per_sec / 1e6);
+  if (rmse_iter != iter)
+      sprintf(err, "RMSE:   -   \tavg RMSE:   -   ");
+  else if (rmse_ci > 0.0)
+      sprintf(err, "RMSE: %3.4f+-%.4f\tavg RMSE: %3.4f+-%.4f", rmse, rmse_ci, rmse_avg, rmse_avg_ci);
+  else
+      sprintf(err, "RMSE: %3.4f\tavg RMSE: %3.4f", rmse, rmse_avg);
+  if (train_iter == iter)
+      sprintf(err + strlen(err), "\ttrain RMSE: %3.4f\tlog-lik: %.6e", train_rmse, train_loglik);
+  sprintf(buf, "%d: %s iteration %d:\t %s\tFU(%6.2f)\tFM(%6.2f)\titems/sec: %6.2f\tratings/sec: %6.2fM\n",
+                    Sys::procid, phase.c_str(), iter, err, norm_u, norm_m, items_per_sec, ratings_per_sec / 1e6);
   Sys::cout() << buf;
 }
 
@@ -108,34 +307,38 @@ void Sys::print(double items_per_sec, double ratings_per_sec, double norm_u, dou
 // Constructor with that reads MTX files
 // 
 Sys::Sys(std::string name, std::string fname, std::string probename)
-    : name(name), iter(-1), assigned(false), dom(nprocs+1)
+    : name(name), rng_id(rng_hash(name)), iter(-1), assigned(false), dom(nprocs+1), T_by_row(false)
 {
 
-    read_matrix(fname, M);
-    read_matrix(probename, T);
-
-    auto rows = std::max(M.rows(), T.rows());
-    auto cols = std::max(M.cols(), T.cols());
-    M.conservativeResize(rows,cols);
-    T.conservativeResize(rows,cols);
-    Pm2 = Pavg = Torig = T; // reference ratings and predicted ratings
-    assert(M.rows() == Pavg.rows());
-    assert(M.cols() == Pavg.cols());
+    SparseMatrixD Mread, Tread;
+    read_matrix(fname, Mread);
+    if (!probename.empty()) read_matrix(probename, Tread); // else no test ratings
+
+    auto rows = std::max(Mread.rows(), Tread.rows());
+    auto cols = std::max(Mread.cols(), Tread.cols());
+    Mread.conservativeResize(rows,cols);
+    Tread.conservativeResize(rows,cols);
+    M = RatingMatrix(Mread);
+    T = std::make_shared<TestMatrix>(Tread);
+    assert(M.rows() == T->rows());
+    assert(M.cols() == T->cols());
     assert(Sys::nprocs <= (int)Sys::max_procs);
 }
 
 //
 // Constructs Sys as transpose of existing Sys
 //
-Sys::Sys(std::string name, const SparseMatrixD &Mt, const SparseMatrixD &Pt) : name(name), iter(-1), assigned(false), dom(nprocs+1) {
+Sys::Sys(std::string name, const RatingMatrix &Mt, std::shared_ptr<TestMatrix> Tt)
+    : name(name), rng_id(rng_hash(name)), iter(-1), assigned(false), dom(nprocs+1), T(Tt), T_by_row(true)
+{
     M = Mt.transpose();
-    Pm2 = Pavg = T = Torig = Pt.transpose(); // reference ratings and predicted ratings
-    assert(M.rows() == Pavg.rows());
-    assert(M.cols() == Pavg.cols());
+    assert(M.rows() == T->cols());
+    assert(M.cols() == T->rows());
 }
 
 Sys::~Sys() 
 {
+    free_replicas();
     if (measure_perf) {
         Sys::cout() << " --------------------\n";
         Sys::cout() << name << ": sampling times on " << procid << "\n";
@@ -163,12 +366,53 @@ void Sys::add_prop_posterior(std::string fnames)
     read_matrix(mu_name, propMu);
     read_matrix(lambda_name, propLambda);
 
+    // Lambda as written by -o: packed upper triangle, column by column
+    if (propLambda.rows() == num_latent * (num_latent + 1) / 2)
+    {
+        Eigen::MatrixXd packed;
+        packed.swap(propLambda);
+        propLambda.resize(num_latent * num_latent, packed.cols());
+        #pragma omp parallel for
+        for(int i = 0; i < packed.cols(); ++i) {
+            const double *p = packed.col(i).data();
+            Eigen::Map<Eigen::MatrixXd> Lambda(propLambda.col(i).data(), num_latent, num_latent);
+            for(int c = 0; c < num_latent; ++c)
+                for(int r = 0; r <= c; ++r, ++p) Lambda(r, c) = Lambda(c, r) = *p;
+        }
+    }
+
     assert(propMu.cols() == num());
     assert(propLambda.cols() == num());
 
     assert(propMu.rows() == num_latent);
     assert(propLambda.rows() == num_latent * num_latent);
 
+    // the priors do not change while sampling: factorize them once
+    propLambdaL.resize(num_latent * (num_latent + 1) / 2, num());
+    propLambdaMu.resize(num_latent, num());
+    bool ok = true;
+    #pragma omp parallel for schedule(guided) reduction(&&:ok)
+    for(int i = 0; i < num(); ++i) {
+        Eigen::Map<Eigen::MatrixXd> Lambda(propLambda.col(i).data(), num_latent, num_latent);
+        Eigen::LLT<Eigen::MatrixXd> llt(Lambda);
+        ok = ok && llt.info() == Eigen::Success;
+
+        double *p = propLambdaL.col(i).data();
+        for(int c = 0; c < num_latent; ++c)
+            for(int r = c; r < num_latent; ++r) *p++ = llt.matrixLLT()(r, c);
+
+        propLambdaMu.col(i) = Lambda * propMu.col(i);
+    }
+
+    if (!ok) THROWERROR("Cholesky of propagated posterior failed");
+}
+
+// unpacks a lower triangle packed by add_prop_posterior, leaves the upper part
+template<int K>
+static void unpack_lower(const double *p, MatrixNNd<K> &L)
+{
+    for(int c = 0; c < num_latent; ++c)
+        for(int r = c; r < num_latent; ++r) L(r, c) = *p++;
 }
 
 //
@@ -179,7 +423,11 @@ void Sys::init()
     //-- M
     assert(M.rows() > 0 && M.cols() > 0);
     mean_rating = M.sum() / M.nonZeros();
-    items().setZero();
+    // zeroed by all threads, so the first touch spreads the pages over
+    // the NUMA nodes of the threads (pinned with -P)
+    const long ld = num_latent_padded();
+#pragma omp parallel for schedule(static)
+    for(int i = 0; i < num(); ++i) std::fill(items_ptr + i * ld, items_ptr + (i + 1) * ld, 0.0); // including the padding
     sum_map().setZero();
     cov_map().setZero();
     norm_map().setZero();
@@ -187,110 +435,169 @@ void Sys::init()
 
     if (Sys::odirname.size())
     {
-        aggrMu = Eigen::MatrixXd::Zero(num_latent, num());
-        aggrLambda = Eigen::MatrixXd::Zero(num_latent * num_latent, num());
+        aggrMu.resize(num_latent, num());
+        aggrLambda.resize(num_latent * (num_latent + 1) / 2, num());
+#pragma omp parallel for schedule(static)
+        for(int i = 0; i < num(); ++i) { aggrMu.col(i).setZero(); aggrLambda.col(i).setZero(); }
     }
 
     Sys::cout() << "mean rating = " << mean_rating << std::endl;
     Sys::cout() << "total number of ratings in train = " << M.nonZeros() << std::endl;
-    Sys::cout() << "total number of ratings in test = " << T.nonZeros() << std::endl;
+    Sys::cout() << "rating storage = " << M.describe() << std::endl;
+    Sys::cout() << "total number of ratings in test = " << T->nonZeros() << std::endl;
     Sys::cout() << "num " << name << ": " << num() << std::endl;
     if (has_prop_posterior())
     {
         Sys::cout() << "with propagated posterior" << std::endl;
     }
 
-    if (measure_perf) sample_time.resize(num(), .0);
+    if (measure_perf || sort_by_cost) sample_time.resize(num(), .0);
 }
 
-class PrecomputedLLT : public Eigen::LLT<MatrixNNd>
+template<int K>
+class PrecomputedLLT : public Eigen::LLT<MatrixNNd<K>>
+{
+  public:
+    PrecomputedLLT() : Eigen::LLT<MatrixNNd<K>>(num_latent) {}
+    void operator=(const MatrixNNd<K> &m) { this->m_matrix = m; this->m_isInitialized = true; this->m_info = Eigen::Success; }
+    void solve_lower(VectorNd<K> &b) const { this->matrixL().solveInPlace(b); }
+    void solve_upper(VectorNd<K> &b) const { this->matrixU().solveInPlace(b); }
+};
+
+//
+// same interface on the unrolled SmallChol kernels
+//
+template<int K>
+class SmallLLT
 {
+    MatrixNNd<K> L;
+    bool ok;
+
   public:
-    void operator=(const MatrixNNd &m) { m_matrix = m; m_isInitialized = true; m_info = Eigen::Success; }
+    void operator=(const MatrixNNd<K> &m) { L = m; ok = true; }
+    void compute(const MatrixNNd<K> &a) { L = a; ok = SmallChol<K>::compute(L.data()); }
+    template<typename Vector>
+    void rankUpdate(const Vector &v, double sigma) {
+        VectorNd<K> x = v * std::sqrt(sigma);
+        ok = ok && SmallChol<K>::rank_update(L.data(), x.data());
+    }
+    Eigen::ComputationInfo info() const { return ok ? Eigen::Success : Eigen::NumericalIssue; }
+    void solve_lower(VectorNd<K> &b) const { SmallChol<K>::solve_lower(L.data(), b.data()); }
+    void solve_upper(VectorNd<K> &b) const { SmallChol<K>::solve_upper(L.data(), b.data()); }
 };
 
+// the unrolled kernels are faster than Eigen up to K = 32 (see bench_chol)
+template<int K>
+using SampleLLT = typename std::conditional<K != Eigen::Dynamic && K <= 32, SmallLLT<K>, PrecomputedLLT<K>>::type;
+
 
 //
 // Update ONE movie or one user
 //
-VectorNd Sys::sample(long idx, const MapNXd in)
+template<int K>
+VectorNd<K> Sys::sample(long idx, const ItemsNXi<K> in)
 {
+    BPMF_DECLARE_REDUCTIONS(K)
+
     auto start = tick();
 
-    VectorNd hp_mu;
-    MatrixNNd hp_LambdaF; 
-    MatrixNNd hp_LambdaL; 
-    if (has_prop_posterior())
-    {
-        hp_mu = propMu.col(idx);
-        hp_LambdaF = Eigen::Map<MatrixNNd>(propLambda.col(idx).data()); 
-        hp_LambdaL =  hp_LambdaF.llt().matrixL();
-    }
-    else
-    {
-        hp_mu = hp.mu;
-        hp_LambdaF = hp.LambdaF; 
-        hp_LambdaL = hp.LambdaL; 
+    // the noise of an item only depends on the seed, the iteration and the item,
+    // not on the thread, the schedule or the assignment to processes
+    rng_seek(rng_id, iter, orig_col(idx));
+
+    const int count = M.nnz(idx); // count of nonzeros elements in idx-th row of M matrix 
+                                                     // (how many movies watched idx-th user?).
+
+    // prior of this item: the hyper-parameters, or its propagated posterior
+    // with the Cholesky factor and Lambda * mu from add_prop_posterior
+    const bool prop = has_prop_posterior();
+    MatrixNNd<K> prop_LambdaL;
+    if (prop && count < breakpoint1) {
+        prop_LambdaL.resize(num_latent, num_latent);
+        unpack_lower<K>(propLambdaL.col(idx).data(), prop_LambdaL);
     }
 
+    ConstMapNd<K> hp_mu(prop ? propMu.col(idx).data() : hp.mu.data(), num_latent);
+    ConstMapNNd<K> hp_LambdaF(prop ? propLambda.col(idx).data() : hp.LambdaF.data(), num_latent, num_latent);
+    ConstMapNNd<K> hp_LambdaL(prop ? prop_LambdaL.data() : hp.LambdaL.data(), num_latent, num_latent);
+    ConstMapNd<K> hp_LambdaF_mu(prop ? propLambdaMu.col(idx).data() : hp.LambdaF_mu.data(), num_latent);
 
-    int breakpoint1 = 24; 
-    int breakpoint2 = 10500; 
-    
-    const int count = M.innerVector(idx).nonZeros(); // count of nonzeros elements in idx-th row of M matrix 
-                                                     // (how many movies watched idx-th user?).
+    // with less ratings than latent dimensions we only factorize a count x count system
+    if( count < breakpoint0 ) {
+        VectorNd<K> rr = sample_woodbury<K>(idx, in, hp_LambdaL, hp_mu);
+        items<K>().col(idx) = rr.template cast<ItemScalar>();
 
-    VectorNd rr = hp_LambdaF * hp.mu;                 // vector num_latent x 1, we will use it in formula (14) from the paper
-    PrecomputedLLT chol;                             // matrix num_latent x num_latent, chol="lambda_i with *" from formula (14) 
+        auto stop = tick();
+        register_time(idx, 1e6 * (stop - start));
+        return rr;
+    }
+
+    VectorNd<K> rr = hp_LambdaF_mu;                    // vector num_latent x 1, we will use it in formula (14) from the paper
+    SampleLLT<K> chol;                                 // matrix num_latent x num_latent, chol="lambda_i with *" from formula (14) 
     
     // if this user movie has less than 1K ratings,
     // we do a serial rank update
     if( count < breakpoint1 ) {
 
         chol = hp_LambdaL;
-        for (SparseMatrixD::InnerIterator it(M,idx); it; ++it) {
-            auto col = in.col(it.row());
+        for (RatingMatrix::InnerIterator it(M,idx); it; ++it) {
+            VectorNd<K> col = in.col(it.row()).template cast<double>();
             chol.rankUpdate(col, alpha);
             rr.noalias() += col * ((it.value() - mean_rating) * alpha);
         }
 
     // else we do a serial full cholesky decomposition
     // (not used if breakpoint1 == breakpoint2)
+    // the latent vectors of the ratings are gathered in tiles that stay in cache,
+    // each tile is a blocked rank-k update (SYRK) of the lower part of MM
     } else if (count < breakpoint2) {
 
-        MatrixNNd MM(MatrixNNd::Zero());
-        for (SparseMatrixD::InnerIterator it(M,idx); it; ++it) {
-            auto col = in.col(it.row());
-            
-            //MM.noalias() += col * col.transpose();
-            calc_upper_part(MM, col);
-            
-            rr.noalias() += col * ((it.value() - mean_rating) * alpha);
+        const int tile = 64;
+        MatrixNNi<K> MM(MatrixNNi<K>::Zero(num_latent, num_latent));
+        VectorNi<K> rri(VectorNi<K>::Zero(num_latent));
+        Eigen::Matrix<ItemScalar, K, tile> V(num_latent, tile);
+        Eigen::Matrix<ItemScalar, tile, 1> w;
+
+        RatingMatrix::InnerIterator it(M,idx);
+        while (it) {
+            int n = 0;
+            for (; it && n < tile; ++it, ++n) {
+                V.col(n) = in.col(it.row());
+                w(n) = (it.value() - mean_rating) * alpha;
+            }
+
+            MM.template selfadjointView<Eigen::Lower>().rankUpdate(V.leftCols(n));
+            rri.noalias() += V.leftCols(n) * w.head(n);
         }
 
-        // Here, we copy a triangular upper part to a triangular lower part, because the matrix is symmetric.
-        copy_lower_part(MM);
-
-        chol.compute(hp_LambdaF + alpha * MM);
-    // for > 1K ratings, we have additional thread-level parallellism
+        // LLT only reads the lower part
+        rr += rri.template cast<double>();
+        chol.compute(hp_LambdaF + alpha * MM.template cast<double>());
+    // for > 1K ratings, we have additional thread-level parallellism:
+    // Sys::sample(Sys &in) samples these items outside its parallel loop,
+    // so the whole team accumulates partial MM and rr
     } else {
-        auto from = M.outerIndexPtr()[idx];   // "from" belongs to [1..m], m - number of movies in M matrix 
-        auto to = M.outerIndexPtr()[idx+1];   // "to"   belongs to [1..m], m - number of movies in M matrix
-        MatrixNNd MM(MatrixNNd::Zero());               // matrix num_latent x num_latent 
+        const long from = M.outerIndexPtr()[idx];   // "from" belongs to [1..m], m - number of movies in M matrix 
+        const long to = M.outerIndexPtr()[idx+1];   // "to"   belongs to [1..m], m - number of movies in M matrix
+        PackedNd<K> MMp(PackedNd<K>::Zero(gram_packed_size(num_latent))); // packed upper part of num_latent x num_latent
+        const int chunk = 200;
  
-        // #pragma omp parallel for reduction(VectorPlus:rr) reduction(MatrixPlus:MM)
-        #pragma omp parallel for reduction(VectorPlus:rr) reduction(MatrixPlus:MM) schedule(dynamic,200)
-        for(int j = from; j<to; ++j) {                 // for each nonzeros elemen in the i-th row of M matrix
-            auto val = M.valuePtr()[j];                // value of the j-th nonzeros element from idx-th row of M matrix
-            auto idx = M.innerIndexPtr()[j];           // index "j" of the element [i,j] from M matrix in compressed M matrix 
-            auto col = in.col(idx);                    // vector num_latent x 1 from V matrix: M[i,j] = U[i,:] x V[idx,:] 
-
-            //MM.noalias() += col * col.transpose();     // outer product
-            calc_upper_part(MM, col);
-            rr.noalias() += col * ((val - mean_rating) * alpha); // vector num_latent x 1
+        #pragma omp parallel for reduction(VectorPlus:rr) reduction(PackedPlus:MMp) schedule(dynamic)
+        for(long j = from; j<to; j += chunk) {          // for each chunk of nonzeros elements in the i-th row of M matrix
+            // in ItemScalar within a chunk, in double across chunks
+            PackedNi<K> chunk_MMp(PackedNi<K>::Zero(gram_packed_size(num_latent)));
+            VectorNi<K> chunk_rr(VectorNi<K>::Zero(num_latent));
+            const int n = std::min(j + chunk, to) - j;
+            double val[chunk];                         // decoded ratings of the chunk
+            M.values(j, j + n, val);
+            gram_accumulate(num_latent, in.data(), in.outerStride(), M.innerIndexPtr() + j, val,
+                            0, n, mean_rating, alpha, chunk_MMp.data(), chunk_rr.data());
+            MMp += chunk_MMp.template cast<double>();
+            rr += chunk_rr.template cast<double>();
         }
 
-        copy_lower_part(MM);
+        MatrixNNd<K> MM(num_latent, num_latent);
+        gram_unpack(num_latent, MMp.data(), MM.data());
 
         chol.compute(hp_LambdaF + alpha * MM);         // matrix num_latent x num_latent
                                                        // chol="lambda_i with *" from formula (14)
@@ -310,10 +617,10 @@ VectorNd Sys::sample(long idx, const MapNXd in)
 
     // Expression u_i = U \ (s + (L \ rr)) in Matlab looks for Eigen library like: 
 
-    chol.matrixL().solveInPlace(rr);                    // L*Y=rr => Y=L\rr, we store Y result again in rr vector  
-    rr += nrandn();                                     // rr=s+(L\rr), we store result again in rr vector
-    chol.matrixU().solveInPlace(rr);                    // u_i=U\rr 
-    items().col(idx) = rr;                              // we save rr vector in items matrix (it is user features matrix)
+    chol.solve_lower(rr);                               // L*Y=rr => Y=L\rr, we store Y result again in rr vector  
+    rr += nrandn<K>();                                    // rr=s+(L\rr), we store result again in rr vector
+    chol.solve_upper(rr);                               // u_i=U\rr 
+    items<K>().col(idx) = rr.template cast<ItemScalar>(); // we save rr vector in items matrix (it is user features matrix)
 
     auto stop = tick();
     register_time(idx, 1e6 * (stop - start));
@@ -324,67 +631,292 @@ VectorNd Sys::sample(long idx, const MapNXd in)
     return rr;
 }
 
+//
+// Update ONE movie or one user with count < num_latent ratings using the Woodbury
+// identity (Bhattacharya et al., "Fast sampling with Gaussian scale-mixture priors
+// in high-dimensional regression", 2016), reusing the Cholesky factor L of the prior
+// precision Lambda = L * L^T:
+//
+//   u = mu + L^-T e,                       e ~ N(0, I_K),  so u ~ N(mu, Lambda^-1)
+//   v = Phi * u + d,                       d ~ N(0, I_count), Phi = sqrt(alpha) * V^T
+//   (Phi Lambda^-1 Phi^T + I) w = z - v,   z = sqrt(alpha) * (ratings - mean_rating)
+//   x = u + Lambda^-1 Phi^T w
+//
+// With B = L^-1 Phi^T this is x = mu + L^-T (e + B w), drawn from the same
+// posterior as the K x K paths in Sys::sample(idx, in)
+//
+template<int K>
+VectorNd<K> Sys::sample_woodbury(long idx, const ItemsNXi<K> in, const ConstMapNNd<K> &LambdaL, const ConstMapNd<K> &mu)
+{
+    typedef Eigen::Matrix<double, K, Eigen::Dynamic, Eigen::ColMajor, K, K> MatrixNCd;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor, K, K> MatrixCCd;
+    typedef Eigen::Matrix<double, Eigen::Dynamic, 1, Eigen::ColMajor, K, 1> VectorCd;
+
+    const int count = nnz(idx);
+    const double sqrt_alpha = sqrt(alpha);
+
+    MatrixNCd B(num_latent, count);   // Phi^T, later L^-1 Phi^T
+    VectorCd z(count);                // z, later w
+    int n = 0;
+    for (RatingMatrix::InnerIterator it(M,idx); it; ++it, ++n) {
+        B.col(n) = in.col(it.row()).template cast<double>() * sqrt_alpha;
+        z(n) = (it.value() - mean_rating) * sqrt_alpha;
+    }
+
+    VectorNd<K> e = nrandn<K>();
+    z.noalias() -= B.transpose() * mu;
+    LambdaL.template triangularView<Eigen::Lower>().solveInPlace(B);
+    z.noalias() -= B.transpose() * e;
+    VectorCd d(count);
+    randn_fill(d.data(), count);
+    z -= d;
+
+    MatrixCCd G(MatrixCCd::Identity(count, count));
+    G.template selfadjointView<Eigen::Lower>().rankUpdate(B.transpose());
+    Eigen::LLT<MatrixCCd> chol(G);
+    if(chol.info() != Eigen::Success) THROWERROR("Cholesky failed");
+    chol.solveInPlace(z);
+
+    e.noalias() += B * z;
+    LambdaL.template triangularView<Eigen::Lower>().transpose().solveInPlace(e);
+
+    return mu + e;
+}
+
+//
+// Update n <= BPMF_SIMD_WIDTH light movies or users at once, one per SIMD lane:
+// their K x K systems are stored interleaved and go in lockstep through the
+// Gram accumulation, Cholesky, noise and solves of the full path in
+// Sys::sample(idx, in). Lanes past n or past the ratings of their item
+// accumulate zeros.
+//
+template<int K>
+void Sys::sample_batch(const int *idx, int n, const ItemsNXi<K> in)
+{
+    const int W = BPMF_SIMD_WIDTH;
+    const int KK = (K == Eigen::Dynamic) ? 1 : K; // not used for dynamic K
+
+    auto start = tick();
+
+    Lanes A[KK * KK], rr[KK], v[KK], av[KK];
+    const VectorNd<K> prior_rr = hp.LambdaF_mu;
+    for (int j = 0; j < K; ++j) {
+        rr[j] = Lanes() + prior_rr(j);
+        for (int i = j; i < K; ++i) A[j * K + i] = Lanes() + hp.LambdaF(i, j);
+    }
+
+    long from[W], to[W];
+    long count = 0;
+    for (int w = 0; w < W; ++w) {
+        from[w] = (w < n) ? M.outerIndexPtr()[idx[w]] : 0;
+        to[w] = (w < n) ? M.outerIndexPtr()[idx[w] + 1] : 0;
+        count = std::max(count, to[w] - from[w]);
+    }
+
+    for (long r = 0; r < count; ++r) {
+        Lanes y = Lanes();
+        for (int w = 0; w < W; ++w) {
+            if (from[w] + r < to[w]) {
+                const ItemScalar *col = in.data() + (long)in.outerStride() * M.innerIndexPtr()[from[w] + r];
+                for (int i = 0; i < K; ++i) v[i][w] = col[i];
+                y[w] = (M.value(from[w] + r) - mean_rating) * alpha;
+            } else {
+                for (int i = 0; i < K; ++i) v[i][w] = 0.0;
+            }
+        }
+
+        BPMF_UNROLL
+        for (int i = 0; i < K; ++i) {
+            av[i] = v[i] * alpha;
+            rr[i] += v[i] * y;
+        }
+
+        // lower part of MM
+        BPMF_UNROLL
+        for (int j = 0; j < K; ++j) {
+            BPMF_UNROLL
+            for (int i = j; i < K; ++i) A[j * K + i] += v[i] * av[j];
+        }
+    }
+
+    if (!SmallChol<KK, Lanes>::compute(A)) THROWERROR("Cholesky failed");
+
+    SmallChol<KK, Lanes>::solve_lower(A, rr);
+    for (int w = 0; w < n; ++w) {
+        double e[KK];
+        rng_seek(rng_id, iter, orig_col(idx[w]));
+        randn_fill(e, K);
+        for (int i = 0; i < K; ++i) rr[i][w] += e[i];
+    }
+    SmallChol<KK, Lanes>::solve_upper(A, rr);
+
+    auto stop = tick();
+    for (int w = 0; w < n; ++w) {
+        for (int i = 0; i < K; ++i) items<K>()(i, idx[w]) = rr[i][w];
+        register_time(idx[w], 1e6 * (stop - start) / n);
+    }
+}
+
+// also used by tune_breakpoints
+#define BPMF_INSTANTIATE_SAMPLE(K, X) \
+    template VectorNd<K> Sys::sample<K>(long, const ItemsNXi<K>);
+
+BPMF_FOR_EACH_NUMLATENT(BPMF_INSTANTIATE_SAMPLE, _)
+BPMF_INSTANTIATE_SAMPLE(Eigen::Dynamic, _)
+
 // 
 // update ALL movies / users in parallel
 //
 void Sys::sample(Sys &in) 
 {
-    iter++;
-    VectorNd  sum(VectorNd::Zero()); // sum
-    double    norm(0.0); // squared norm
-    MatrixNNd prod(MatrixNNd::Zero()); // outer prod
+#define BPMF_SAMPLE(K) sample<K>(in)
+    BPMF_DISPATCH_NUMLATENT(BPMF_SAMPLE)
+#undef BPMF_SAMPLE
+}
+
+//
+// adds the new sample r of item i to the statistics for the hyper-parameters
+// (only the lower part of prod) and to the aggregated posterior
+//
+template<int K>
+static void add_sample(Sys &s, int i, const VectorNd<K> &r, VectorNd<K> &sum, MatrixNNd<K> &prod, double &norm)
+{
+    for (int c = 0; c < num_latent; ++c) prod.col(c).tail(num_latent - c) += r.tail(num_latent - c) * r(c);
+    sum += r;
+    norm += r.squaredNorm();
 
-//#pragma omp parallel for reduction(VectorPlus:sum) reduction(MatrixPlus:prod) reduction(+:norm) schedule(dynamic, 1)
-#pragma omp parallel for reduction(VectorPlus:sum) reduction(MatrixPlus:prod) reduction(+:norm) schedule(dynamic,1) 
-    for(int i = from(); i<to(); ++i) {
-        auto r = sample(i,in.items());
+    // Welford update of the mean and of the squared deviations of the n samples
+    if (s.iter >= Sys::burnin && Sys::odirname.size())
+    {
+        const double n = s.iter - Sys::burnin + 1;
+        auto mean = s.aggrMu.col(i);
+        const VectorNd<K> delta = r - mean.template cast<double>();
+        mean += (delta / n).template cast<AggrScalar>();
+
+        const double f = (n - 1) / n;
+        AggrScalar *m2 = s.aggrLambda.col(i).data();
+        for (int c = 0; c < num_latent; ++c)
+            for (int k = 0; k <= c; ++k) *m2++ += f * delta(k) * delta(c);
+    }
+}
 
-        MatrixNNd cov = (r * r.transpose());
-        prod += cov;
-        sum += r;
-        norm += r.squaredNorm();
+template<int K>
+void Sys::sample(Sys &in) 
+{
+    BPMF_DECLARE_REDUCTIONS(K)
 
-        if (iter >= burnin && Sys::odirname.size())
-        {
-            aggrMu.col(i) += r;
-            aggrLambda.col(i) += Eigen::Map<Eigen::VectorXd>(cov.data(), num_latent * num_latent);
+    iter++;
+    if (predict_in_sample && avg_count(iter) == 0) nhistory = 0; // restarted anyway
+    in.replicate();
+    VectorNd<K>  sum(VectorNd<K>::Zero(num_latent)); // sum
+    double       norm(0.0); // squared norm
+    MatrixNNd<K> prod(MatrixNNd<K>::Zero(num_latent, num_latent)); // outer prod
+    double se(0.0), se_avg(0.0); // squared errors of the test ratings, with predict_in_sample
+    long nump(0);
+
+    // heavy items first, one at a time, each sampled by all threads
+    // in the thread-parallel path of sample(idx, in)
+    {
+        BPMF_COUNTER("heavy");
+        for(int i = from(); i<to(); ++i) {
+            if (nnz(i) < breakpoint2) continue;
+
+            auto r = sample<K>(i,in.items_near<K>());
+            add_sample<K>(*this, i, r, sum, prod, norm);
+            if (predict_in_sample) predict_item(i, in.near_items_ptr(), se, se_avg, nump);
+            send_items(i, i + 1);
+        }
+    }
+
+    // light items with less than breakpoint_batch ratings, BPMF_SIMD_WIDTH at a time
+    // ordered by number of ratings, so the lanes of a batch do similar work
+    const bool batched = (K != Eigen::Dynamic) && breakpoint_batch > 0 && !has_prop_posterior();
+    if (batched) {
+        BPMF_COUNTER("batch");
+        batch_order.clear();
+        for(int i = from(); i<to(); ++i) 
+            if (nnz(i) < breakpoint_batch) batch_order.push_back(i);
+        std::sort(batch_order.begin(), batch_order.end(),
+                [this](int a, int b) { return nnz(a) < nnz(b) || (nnz(a) == nnz(b) && a < b); });
+
+        const int n = batch_order.size();
+#pragma omp parallel for reduction(VectorPlus:sum) reduction(MatrixPlus:prod) reduction(+:norm,se,se_avg,nump) schedule(dynamic,grain_size)
+        for(int b = 0; b<n; b += BPMF_SIMD_WIDTH) {
+            const int nb = std::min(BPMF_SIMD_WIDTH, n - b);
+            sample_batch<K>(&batch_order[b], nb, in.items_near<K>());
+
+            for(int w = 0; w<nb; ++w) {
+                const int i = batch_order[b + w];
+                VectorNd<K> r = items<K>().col(i).template cast<double>();
+                add_sample<K>(*this, i, r, sum, prod, norm);
+                if (predict_in_sample) predict_item(i, in.near_items_ptr(), se, se_avg, nump);
+                send_items(i, i + 1);
+            }
         }
+    }
 
-        send_items(i, i + 1);
+    // then the long tail of light items, one thread per item,
+    // handed out in chunks of grain_size items
+    {
+        BPMF_COUNTER("light");
+        if (sort_by_cost) order_by_cost();
+        const int n = sort_by_cost ? sample_order.size() : num(procid);
+#pragma omp parallel for reduction(VectorPlus:sum) reduction(MatrixPlus:prod) reduction(+:norm,se,se_avg,nump) schedule(dynamic,grain_size)
+        for(int j = 0; j<n; ++j) {
+            const int i = sort_by_cost ? sample_order[j] : from() + j;
+            if (nnz(i) >= breakpoint2) continue;
+            if (batched && nnz(i) < breakpoint_batch) continue;
+
+            auto r = sample<K>(i,in.items_near<K>());
+            add_sample<K>(*this, i, r, sum, prod, norm);
+            if (predict_in_sample) predict_item(i, in.near_items_ptr(), se, se_avg, nump);
+            send_items(i, i + 1);
+        }
     }
 
     const int N = num();
+    prod.template triangularView<Eigen::StrictlyUpper>() = prod.transpose();
     local_sum() = sum;
     local_cov() = (prod - (sum * sum.transpose() / N)) / (N-1);
     local_norm() = norm;
 
+    if (predict_in_sample) nhistory = 0;
+    if (predict_in_sample && nump) {
+        rmse = sqrt( se / nump );
+        rmse_avg = sqrt( se_avg / nump );
+        rmse_ci = rmse_avg_ci = 0.0;
+        rmse_iter = iter;
+    }
+
 }
 
-void Sys::register_time(int i, double t)
+void Sys::sample_hp()
 {
-    if (measure_perf) sample_time.at(i) += t;
+#define BPMF_SAMPLE_HP(K) sample_hp<K>()
+    BPMF_DISPATCH_NUMLATENT(BPMF_SAMPLE_HP)
+#undef BPMF_SAMPLE_HP
 }
 
-void calc_upper_part(MatrixNNd &m, VectorNd v)
+//
+// orders the local light items largest cost first: by the measured
+// sampling time once all items have been sampled, else by number of ratings
+//
+void Sys::order_by_cost()
 {
-  // we use the formula: m = m + v * v.transpose(), but we calculate only an upper part of m matrix
-  for (int j=0; j<num_latent; j++)          // columns
-  {
-    for(int i=0; i<=j; i++)              // rows
-    {
-      m(i,j) = m(i,j) + v[j] * v[i];
-    }
-  }
+    sample_order.clear();
+    for(int i = from(); i<to(); ++i) 
+        if (nnz(i) < breakpoint2) sample_order.push_back(i);
+
+    // ties by index, std::stable_sort would allocate
+    if (iter > 0)
+        std::sort(sample_order.begin(), sample_order.end(),
+                [this](int a, int b) { return sample_time[a] > sample_time[b] || (sample_time[a] == sample_time[b] && a < b); });
+    else
+        std::sort(sample_order.begin(), sample_order.end(),
+                [this](int a, int b) { return nnz(a) > nnz(b) || (nnz(a) == nnz(b) && a < b); });
 }
 
-void copy_lower_part(MatrixNNd &m)
+void Sys::register_time(int i, double t)
 {
-  // Here, we copy a triangular upper part to a triangular lower part, because the matrix is symmetric.
-  for (int j=1; j<num_latent; j++)          // columns
-  {
-    for(int i=0; i<=j-1; i++)            // rows
-    {
-      m(j,i) = m(i,j);
-    }
-  }
+    if (measure_perf || sort_by_cost) sample_time.at(i) += t;
 }
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <climits>
+
+#include "sddmm.h"
+
+template<typename T>
+static void column(int K, const T *a, const T *b, long ldb, const int *idx, long n, double *out)
+{
+    // the vectors of b are random reads: prefetch a few nonzeros ahead
+    const int ahead = 8;
+    const int lines = (K * sizeof(T) + 63) / 64;
+    for (long j = 0; j < n; ++j)
+    {
+        if (j + ahead < n)
+        {
+            const char *f = (const char *)(b + ldb * idx[j + ahead]);
+            for (int l = 0; l < lines; ++l) __builtin_prefetch(f + 64 * l);
+        }
+
+        const T *v = b + ldb * idx[j];
+        double s = 0.0;
+        #pragma omp simd reduction(+:s)
+        for (int i = 0; i < K; ++i) s += (double)a[i] * v[i];
+        out[j] = s;
+    }
+}
+
+template<typename T>
+static void blocked(int K, const T *a, long lda, const T *b, long ldb, int nrows,
+                    const SparseIndex *ptr, const int *idx, int c0, int c1, double *out)
+{
+    const int block = 256;                                                // columns
+    const long l2_tile = std::max(64L, (256L << 10) / (ldb * (long)sizeof(T))); // rows of b, 256 KB
+    SparseIndex cur[block];                                               // next nonzero of each column
+
+    for (int cb = c0; cb < c1; cb += block)
+    {
+        const int ce = std::min(cb + block, c1);
+        for (int c = cb; c < ce; ++c) cur[c - cb] = ptr[c];
+
+        // without tiles when the block reads a small part of b, the visits of
+        // the columns in each tile would cost more than the locality saves
+        const long nnz = ptr[ce] - ptr[cb];
+        const long tile = (8 * nnz < nrows) ? nrows : std::max(l2_tile, nrows / std::max(nnz / (ce - cb), 1L));
+
+        for (long r0 = 0; r0 < nrows; r0 += tile)
+        {
+            const long r1 = (r0 + tile < nrows) ? r0 + tile : LONG_MAX; // the last tile takes the rest
+            for (int c = cb; c < ce; ++c)
+            {
+                const SparseIndex p = cur[c - cb], e = ptr[c + 1];
+                SparseIndex q = p;
+                while (q < e && idx[q] < r1) ++q;
+                column(K, a + lda * c, b, ldb, idx + p, q - p, out + (p - ptr[c0]));
+                cur[c - cb] = q;
+            }
+        }
+    }
+}
+
+void sddmm(int K, const double *a, long lda, const double *b, long ldb, int nrows,
+           const SparseIndex *ptr, const int *idx, int c0, int c1, double *out)
+{
+    blocked(K, a, lda, b, ldb, nrows, ptr, idx, c0, c1, out);
+}
+
+void sddmm(int K, const float *a, long lda, const float *b, long ldb, int nrows,
+           const SparseIndex *ptr, const int *idx, int c0, int c1, double *out)
+{
+    blocked(K, a, lda, b, ldb, nrows, ptr, idx, c0, c1, out);
+}
+
+void sddmm_column(int K, const double *a, const double *b, long ldb, const int *idx, long n, double *out)
+{
+    column(K, a, b, ldb, idx, n, out);
+}
+
+void sddmm_column(int K, const float *a, const float *b, long ldb, const int *idx, long n, double *out)
+{
+    column(K, a, b, ldb, idx, n, out);
+}
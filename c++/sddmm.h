@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include "io.h"
+
+//
+// Sampled dense-dense matrix product (SDDMM): the dot product of the latent
+// vectors of both sides for each nonzero of a sparse pattern, as needed for the
+// predictions of the test ratings and for the training log-likelihood
+//
+// For the nonzeros p of the columns [c0, c1) of the CSC pattern (ptr, idx),
+// whose row indices are below nrows:
+//    out[p - ptr[c0]] = a(:, c)' * b(:, idx[p]),  a(:, c) = a + lda * c, b(:, r) = b + ldb * r
+// in double precision, K values per vector. The columns are taken in blocks,
+// and each block tile by tile of the rows of b that fit in L2: each b(:, r)
+// comes from memory once per block instead of once per nonzero (see
+// bench_sddmm). Any row order within a column is valid, sorted rows make the
+// tiles effective.
+//
+void sddmm(int K, const double *a, long lda, const double *b, long ldb, int nrows,
+           const SparseIndex *ptr, const int *idx, int c0, int c1, double *out);
+void sddmm(int K, const float *a, long lda, const float *b, long ldb, int nrows,
+           const SparseIndex *ptr, const int *idx, int c0, int c1, double *out);
+
+// one column: out[j] = a' * b(:, idx[j]) for j in [0, n), the kernel of sddmm
+void sddmm_column(int K, const double *a, const double *b, long ldb, const int *idx, long n, double *out);
+void sddmm_column(int K, const float *a, const float *b, long ldb, const int *idx, long n, double *out);
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <cmath>
+
+//
+// Cholesky factorization, rank-one update and triangular solves for a small
+// compile-time K, on column-major K x K arrays holding the lower factor L of
+// A = L * L^T. All loop bounds are known at compile time and the loops are
+// unrolled completely, which removes the loop and branch overhead of the
+// generic Eigen LLT for K up to about 32.
+//
+// T is double, or Lanes to solve BPMF_SIMD_WIDTH independent systems stored
+// interleaved (element (i,j) of system w at [j * K + i][w]) in lockstep.
+//
+
+#define BPMF_UNROLL _Pragma("GCC unroll 32")
+
+#ifndef BPMF_SIMD_WIDTH
+#define BPMF_SIMD_WIDTH 4
+#endif
+
+typedef double Lanes __attribute__((vector_size(BPMF_SIMD_WIDTH * sizeof(double))));
+
+inline double chol_sqrt(double x) { return std::sqrt(x); }
+inline bool chol_positive(double x) { return x > 0; }
+
+inline Lanes chol_sqrt(Lanes x)
+{
+    for (int w = 0; w < BPMF_SIMD_WIDTH; ++w) x[w] = std::sqrt(x[w]);
+    return x;
+}
+
+inline bool chol_positive(Lanes x)
+{
+    bool ok = true;
+    for (int w = 0; w < BPMF_SIMD_WIDTH; ++w) ok = ok && x[w] > 0;
+    return ok;
+}
+
+template<int K, typename T = double>
+struct SmallChol
+{
+    // factorizes the lower triangle of a in place, left-looking by column
+    // returns false if a is not positive definite
+    static bool compute(T *a)
+    {
+        BPMF_UNROLL
+        for (int j = 0; j < K; ++j)
+        {
+            T *cj = a + j * K;
+            BPMF_UNROLL
+            for (int k = 0; k < j; ++k)
+            {
+                const T *ck = a + k * K;
+                const T f = ck[j];
+                BPMF_UNROLL
+                for (int i = j; i < K; ++i) cj[i] -= ck[i] * f;
+            }
+
+            if (!chol_positive(cj[j])) return false;
+            const T d = chol_sqrt(cj[j]);
+            const T inv = 1.0 / d;
+            cj[j] = d;
+            BPMF_UNROLL
+            for (int i = j + 1; i < K; ++i) cj[i] *= inv;
+        }
+
+        return true;
+    }
+
+    // L * L^T + x * x^T, x is overwritten
+    static bool rank_update(T *l, T *x)
+    {
+        BPMF_UNROLL
+        for (int k = 0; k < K; ++k)
+        {
+            T *ck = l + k * K;
+            const T r = chol_sqrt(ck[k] * ck[k] + x[k] * x[k]);
+            if (!chol_positive(r)) return false;
+            const T inv = 1.0 / ck[k];
+            const T c = r * inv;
+            const T s = x[k] * inv;
+            const T inv_c = 1.0 / c;
+            ck[k] = r;
+            BPMF_UNROLL
+            for (int i = k + 1; i < K; ++i)
+            {
+                ck[i] = (ck[i] + s * x[i]) * inv_c;
+                x[i] = c * x[i] - s * ck[i];
+            }
+        }
+
+        return true;
+    }
+
+    // b = L \ b
+    static void solve_lower(const T *l, T *b)
+    {
+        BPMF_UNROLL
+        for (int j = 0; j < K; ++j)
+        {
+            const T *cj = l + j * K;
+            b[j] /= cj[j];
+            BPMF_UNROLL
+            for (int i = j + 1; i < K; ++i) b[i] -= cj[i] * b[j];
+        }
+    }
+
+    // b = L^T \ b
+    static void solve_upper(const T *l, T *b)
+    {
+        BPMF_UNROLL
+        for (int j = K - 1; j >= 0; --j)
+        {
+            const T *cj = l + j * K;
+            T s = b[j];
+            BPMF_UNROLL
+            for (int i = j + 1; i < K; ++i) s -= cj[i] * b[i];
+            b[j] = s / cj[j];
+        }
+    }
+};
@@ -15,12 +15,11 @@ int main() {
         SendBuffer<double> sb(Sys::procid, 3);
         RecvBuffer<double> rb(Sys::procid, 3);
         
-        sb.put(42.0);
-        sb.put(420.0);
-        sb.put(4200.0);
-        Sys::cout() << "a = " << rb.get() << std::endl;
-        Sys::cout() << "a = " << rb.get() << std::endl;
-        Sys::cout() << "a = " << rb.get() << std::endl;
+        double a[] = { 42.0, 420.0, 4200.0 };
+        sb.put(&a[0]);
+        sb.put(&a[1]);
+        sb.put(&a[2]);
+        for(int i=0; i<3; ++i) { rb.get(&a[i]); Sys::cout() << "a = " << a[i] << std::endl; }
 
         }
         Sys::Finalize();
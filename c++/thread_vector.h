@@ -10,6 +10,10 @@
 #include <omp.h>
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
 
 namespace threads
 {
@@ -57,6 +61,32 @@ inline bool is_master()
     return get_thread_num() == 0;
 }
 
+// binds thread i to the i-th cpu the process may run on, so the pages it first
+// touches stay on its NUMA node; returns false if not supported
+inline bool pin()
+{
+#if defined(_OPENMP) && defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) return false;
+
+    std::vector<int> cpus;
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+
+    bool ok = true;
+#pragma omp parallel reduction(&&:ok)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &set);
+        ok = sched_setaffinity(0, sizeof(set), &set) == 0; // 0 is the calling thread
+    }
+    return ok;
+#else
+    return false;
+#endif
+}
+
 } // namespace threads
 
 template <typename T>
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "error.h"
+#include "bpmf.h"
+#include "gram.h"
+#include "tune.h"
+
+// largest number of ratings of a synthetic column
+static const int max_count = 1 << 15;
+
+//
+// Sys with synthetic ratings, only used to time Sys::sample(idx, in)
+//
+struct TuneSys : public Sys
+{
+    Eigen::Matrix<ItemScalar, Eigen::Dynamic, Eigen::Dynamic> data;
+
+    TuneSys(const SparseMatrixD &Mt)
+        : Sys("tune", RatingMatrix(Mt), std::make_shared<TestMatrix>(Mt)), data(Eigen::Matrix<ItemScalar, Eigen::Dynamic, Eigen::Dynamic>::Zero(num_latent_padded(), num()))
+    {
+        items_ptr = data.data();
+        col_permutation.setIdentity(num());
+        sample_time.resize(num());
+        mean_rating = 3.0;
+        hp.mu = hp.LambdaF_mu = Eigen::VectorXd::Zero(num_latent);
+        hp.LambdaF = hp.LambdaU = hp.LambdaL = Eigen::MatrixXd::Identity(num_latent, num_latent);
+    }
+
+    virtual void alloc_and_init() {}
+    virtual void send_items(int, int) {}
+};
+
+// breakpoint0/1/2 that force one path
+static const int woodbury_path[3] = { -1, INT_MAX, INT_MAX }; // breakpoint0 = num_latent
+static const int rank_path[3]     = { 0, INT_MAX, INT_MAX };
+static const int full_path[3]     = { 0, 0, INT_MAX };
+static const int parallel_path[3] = { 0, 0, 0 };
+
+// best of three, each repeating the sample for at least 1ms
+template<int K>
+static double time_path(TuneSys &s, const ItemsNXi<K> in, int idx, const int *path)
+{
+    Sys::breakpoint0 = path[0] < 0 ? num_latent : path[0];
+    Sys::breakpoint1 = path[1];
+    Sys::breakpoint2 = path[2];
+
+    double best = 1e30;
+    for (int rep = 0; rep < 3; ++rep)
+    {
+        int n = 0;
+        double start = tick(), elapsed;
+        do {
+            s.sample<K>(idx, in);
+            n++;
+        } while ((elapsed = tick() - start) < 1e-3);
+        best = std::min(best, elapsed / n);
+    }
+
+    return best;
+}
+
+// first count in [lo, hi) from which path b is 5% faster than path a at two consecutive columns
+template<int K>
+static int crossover(TuneSys &s, const ItemsNXi<K> in, const int *a, const int *b, int lo, int hi)
+{
+    int wins = 0;
+    for (int i = 0; i < s.num() && s.nnz(i) < hi; ++i)
+    {
+        if (s.nnz(i) < lo) continue;
+        if (time_path<K>(s, in, i, b) < 0.95 * time_path<K>(s, in, i, a))
+        {
+            if (++wins == 2) return s.nnz(i - 1);
+        }
+        else
+        {
+            wins = 0;
+        }
+    }
+
+    return hi;
+}
+
+// selects the fastest supported gram_accumulate kernel on column idx
+static void tune_gram_kernel(const TuneSys &s, const ItemScalar *in, int idx)
+{
+    const char *best = gram_kernel_name();
+    double best_time = 1e30;
+    std::vector<ItemScalar> packed(gram_packed_size(num_latent)), rr(num_latent);
+    auto from = s.M.outerIndexPtr()[idx];
+    auto to = s.M.outerIndexPtr()[idx + 1];
+    std::vector<double> val(to - from);
+    s.M.values(from, to, val.data());
+
+    for (const char *name : { "avx512", "avx2", "scalar" })
+    {
+        if (!gram_select_kernel(name)) continue;
+
+        int n = 0;
+        double start = tick(), elapsed;
+        do {
+            gram_accumulate(num_latent, in, num_latent_padded(), s.M.innerIndexPtr() + from, val.data(), 0, to - from,
+                            s.mean_rating, Sys::alpha, packed.data(), rr.data());
+            n++;
+        } while ((elapsed = tick() - start) < 1e-2);
+
+        if (elapsed / n < best_time)
+        {
+            best_time = elapsed / n;
+            best = name;
+        }
+    }
+
+    gram_select_kernel(best);
+}
+
+template<int K>
+static void tune_breakpoints()
+{
+    // one synthetic column per count, counts grow by 25%
+    std::vector<Eigen::Triplet<double>> ratings;
+    int ncols = 0;
+    for (int c = 1; c <= max_count; c = std::max(c + 1, c + c / 4), ncols++)
+        for (int j = 0; j < c; ++j)
+            ratings.push_back(Eigen::Triplet<double>(ncols, (j * 7919L + ncols) % max_count, 1 + (j + ncols) % 5));
+
+    SparseMatrixD Mt(ncols, max_count);
+    Mt.setFromTriplets(ratings.begin(), ratings.end());
+    TuneSys s(Mt);
+
+    Eigen::Matrix<ItemScalar, Eigen::Dynamic, Eigen::Dynamic> in_data;
+    in_data.setZero(num_latent_padded(), max_count);
+    in_data.topRows(num_latent).setRandom();
+    ItemsNXi<K> in(in_data.data(), num_latent, max_count, Eigen::OuterStride<>(num_latent_padded()));
+
+    tune_gram_kernel(s, in_data.data(), ncols - 1);
+
+    int breakpoint0 = crossover<K>(s, in, woodbury_path, rank_path, 1, num_latent);
+    int breakpoint1 = crossover<K>(s, in, rank_path, full_path, 1, INT_MAX);
+    int breakpoint2 = crossover<K>(s, in, full_path, parallel_path, breakpoint1, INT_MAX);
+
+    Sys::breakpoint0 = breakpoint0;
+    Sys::breakpoint1 = breakpoint1;
+    Sys::breakpoint2 = breakpoint2;
+}
+
+void tune_breakpoints()
+{
+#define BPMF_TUNE(K) tune_breakpoints<K>()
+    BPMF_DISPATCH_NUMLATENT(BPMF_TUNE)
+#undef BPMF_TUNE
+}
+
+bool read_tune_profile(const std::string &fname)
+{
+    std::ifstream f(fname);
+    if (!f.good()) return false;
+
+    std::map<std::string, std::string> profile;
+    std::string key, value;
+    while (f >> key >> value) profile[key] = value;
+
+    for (auto k : { "num_latent", "nthrds", "gram_kernel", "breakpoint0", "breakpoint1", "breakpoint2" })
+        if (!profile.count(k)) return false;
+
+    if (std::stoi(profile["num_latent"]) != num_latent) return false;
+    if (std::stoi(profile["nthrds"]) != threads::get_max_threads()) return false;
+    if (!gram_select_kernel(profile["gram_kernel"].c_str())) return false;
+
+    Sys::breakpoint0 = std::min(std::stoi(profile["breakpoint0"]), num_latent);
+    Sys::breakpoint1 = std::stoi(profile["breakpoint1"]);
+    Sys::breakpoint2 = std::stoi(profile["breakpoint2"]);
+
+    return true;
+}
+
+void write_tune_profile(const std::string &fname)
+{
+    std::ofstream f(fname);
+    THROWERROR_ASSERT_MSG(f.good(), "Error opening file: " + fname);
+
+    f << "num_latent " << num_latent << "\n";
+    f << "nthrds " << threads::get_max_threads() << "\n";
+    f << "gram_kernel " << gram_kernel_name() << "\n";
+    f << "breakpoint0 " << Sys::breakpoint0 << "\n";
+    f << "breakpoint1 " << Sys::breakpoint1 << "\n";
+    f << "breakpoint2 " << Sys::breakpoint2 << "\n";
+}
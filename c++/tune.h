@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2014-2016, imec
+ * All rights reserved.
+ */
+
+#pragma once
+
+#include <string>
+
+//
+// Calibration of the sampling paths in Sys::sample(idx, in)
+//
+// Times the Woodbury, rank-update, full-Cholesky and thread-parallel paths on
+// synthetic columns for the current num_latent and number of threads, and sets
+// Sys::breakpoint0/1/2 to the measured crossovers. Also selects the fastest
+// gram_accumulate kernel.
+//
+void tune_breakpoints();
+
+// reads a profile written by write_tune_profile, returns false if the file does
+// not exist or was tuned for another num_latent or number of threads
+bool read_tune_profile(const std::string &fname);
+
+void write_tune_profile(const std::string &fname);